@@ -224,22 +224,22 @@ int main(int argc, char *argv[])
     special_end   = "}\x1b[m";
   }
 
-  /* Size matters not for the parser */
-  VTerm *vt = vterm_new(25, 80);
-  vterm_set_utf8(vt, 1);
-  vterm_parser_set_callbacks(vt, &parser_cbs, NULL);
-  vterm_parser_set_emit_nul(vt, true);
+  VTermParser *parser = vterm_parser_build(&(const struct VTermParserBuilder){
+      .callbacks = &parser_cbs,
+      .utf8      = true,
+      .emit_nul  = true,
+    });
 
   int len;
   char buffer[1024];
   while((len = read(fd, buffer, sizeof(buffer))) > 0) {
-    vterm_input_write(vt, buffer, len);
+    vterm_parser_write(parser, buffer, len);
   }
 
   printf("\n");
 
   close(fd);
-  vterm_free(vt);
+  vterm_parser_free(parser);
 
   return 0;
 }
@@ -0,0 +1,265 @@
+// Require getopt(3) and clock_gettime(3)
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#define streq(a,b) (strcmp(a,b)==0)
+
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "vterm.h"
+
+/*
+ * vterm-journal [OPTIONS] record [FILE]
+ *   Parses the terminal sequences in FILE (or stdin) and writes a journal of
+ *   the parser events to stdout.
+ *
+ * vterm-journal [OPTIONS] replay [FILE]
+ *   Replays a journal from FILE (or stdin) into a terminal and prints the
+ *   final contents of its screen.
+ *
+ * vterm-journal [OPTIONS] bench FILE
+ *   Compares the throughput of writing the terminal sequences in FILE into a
+ *   terminal against replaying a journal of them.
+ *
+ * OPTIONS:
+ *   -l LINES,
+ *   -c COLS    -- set the size of the emulated terminal
+ */
+
+static int rows = 25;
+static int cols = 80;
+
+static int open_input(const char *file)
+{
+  if(!file || streq(file, "-"))
+    return 0; // stdin
+
+  int fd = open(file, O_RDONLY);
+  if(fd == -1) {
+    fprintf(stderr, "Cannot open %s - %s\n", file, strerror(errno));
+    exit(1);
+  }
+  return fd;
+}
+
+static char *slurp(const char *file, size_t *lenp)
+{
+  int fd = open_input(file);
+
+  size_t len = 0, size = 65536;
+  char *buffer = malloc(size);
+
+  ssize_t got;
+  while((got = read(fd, buffer + len, size - len)) > 0) {
+    len += got;
+    if(len == size)
+      buffer = realloc(buffer, size *= 2);
+  }
+
+  close(fd);
+
+  *lenp = len;
+  return buffer;
+}
+
+static void write_stdout(const char *s, size_t len, void *user)
+{
+  fwrite(s, len, 1, stdout);
+}
+
+struct membuf {
+  char  *bytes;
+  size_t len, size;
+};
+
+static void write_membuf(const char *s, size_t len, void *user)
+{
+  struct membuf *buf = user;
+
+  if(buf->len + len > buf->size) {
+    while(buf->len + len > buf->size)
+      buf->size = buf->size ? buf->size * 2 : 65536;
+    buf->bytes = realloc(buf->bytes, buf->size);
+  }
+
+  memcpy(buf->bytes + buf->len, s, len);
+  buf->len += len;
+}
+
+static VTerm *new_terminal(void)
+{
+  VTerm *vt = vterm_new(rows, cols);
+  vterm_set_utf8(vt, true);
+
+  VTermScreen *vts = vterm_obtain_screen(vt);
+  vterm_screen_reset(vts, 1);
+
+  return vt;
+}
+
+static void dump_screen(VTerm *vt)
+{
+  VTermScreen *vts = vterm_obtain_screen(vt);
+  char line[1024];
+
+  for(int row = 0; row < rows; row++) {
+    size_t len = vterm_screen_get_text(vts, line, sizeof(line),
+        (VTermRect){ .start_row = row, .end_row = row + 1, .start_col = 0, .end_col = cols });
+
+    /* Trailing blanks are just erased cells */
+    while(len && line[len-1] == ' ')
+      len--;
+    printf("%.*s\n", (int)len, line);
+  }
+}
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int cmd_record(const char *file)
+{
+  int fd = open_input(file);
+
+  /* Size matters not for the parser */
+  VTerm *vt = vterm_new(25, 80);
+  vterm_set_utf8(vt, true);
+  vterm_journal_start(vt, write_stdout, NULL);
+
+  ssize_t len;
+  char buffer[4096];
+  while((len = read(fd, buffer, sizeof(buffer))) > 0)
+    vterm_input_write(vt, buffer, len);
+
+  vterm_journal_stop(vt);
+
+  close(fd);
+  vterm_free(vt);
+
+  return 0;
+}
+
+static int cmd_replay(const char *file)
+{
+  int fd = open_input(file);
+
+  VTerm *vt = new_terminal();
+
+  /* Records can straddle reads, so keep any partial one to go again with
+   * what follows it */
+  size_t len = 0;
+  ssize_t got;
+  char buffer[65536];
+  while((got = read(fd, buffer + len, sizeof(buffer) - len)) > 0) {
+    len += got;
+    size_t done = vterm_journal_replay(vt, buffer, len);
+    if(!done && len == sizeof(buffer))
+      break;
+    memmove(buffer, buffer + done, len - done);
+    len -= done;
+  }
+
+  close(fd);
+
+  if(len) {
+    fprintf(stderr, "Invalid or truncated journal\n");
+    vterm_free(vt);
+    return 1;
+  }
+
+  dump_screen(vt);
+
+  vterm_free(vt);
+
+  return 0;
+}
+
+static int cmd_bench(const char *file)
+{
+  size_t rawlen;
+  char *raw = slurp(file, &rawlen);
+
+  struct membuf journal = { 0 };
+  VTerm *vt = vterm_new(25, 80);
+  vterm_set_utf8(vt, true);
+  vterm_journal_start(vt, write_membuf, &journal);
+  vterm_input_write(vt, raw, rawlen);
+  vterm_journal_stop(vt);
+  vterm_free(vt);
+
+  double best_write = 0, best_replay = 0;
+
+  for(int rep = 0; rep < 5; rep++) {
+    vt = new_terminal();
+    double start = now();
+    for(size_t pos = 0; pos < rawlen; pos += 4096)
+      vterm_input_write(vt, raw + pos, rawlen - pos < 4096 ? rawlen - pos : 4096);
+    double t = now() - start;
+    vterm_free(vt);
+    if(!rep || t < best_write)
+      best_write = t;
+
+    vt = new_terminal();
+    start = now();
+    size_t done = vterm_journal_replay(vt, journal.bytes, journal.len);
+    t = now() - start;
+    vterm_free(vt);
+    if(done < journal.len) {
+      fprintf(stderr, "Journal replay stopped at %zu of %zu bytes\n", done, journal.len);
+      return 1;
+    }
+    if(!rep || t < best_replay)
+      best_replay = t;
+  }
+
+  printf("input:   %zu bytes\n", rawlen);
+  printf("journal: %zu bytes (%.0f%%)\n", journal.len, 100.0 * journal.len / rawlen);
+  printf("vterm_input_write:    %.1f MB/s\n", rawlen / best_write / 1e6);
+  printf("vterm_journal_replay: %.1f MB/s\n", rawlen / best_replay / 1e6);
+
+  free(journal.bytes);
+  free(raw);
+
+  return 0;
+}
+
+int main(int argc, char *argv[])
+{
+  int opt;
+  while((opt = getopt(argc, argv, "l:c:")) != -1) {
+    switch(opt) {
+      case 'l':
+        rows = atoi(optarg);
+        if(!rows)
+          rows = 25;
+        break;
+
+      case 'c':
+        cols = atoi(optarg);
+        if(!cols)
+          cols = 80;
+        break;
+    }
+  }
+
+  const char *cmd  = optind < argc ? argv[optind++] : NULL;
+  const char *file = optind < argc ? argv[optind++] : NULL;
+
+  if(cmd && streq(cmd, "record"))
+    return cmd_record(file);
+  if(cmd && streq(cmd, "replay"))
+    return cmd_replay(file);
+  if(cmd && streq(cmd, "bench") && file)
+    return cmd_bench(file);
+
+  fprintf(stderr, "Usage: vterm-journal [-l LINES] [-c COLS] record|replay|bench FILE\n");
+  return 1;
+}
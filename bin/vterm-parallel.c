@@ -0,0 +1,340 @@
+// Require getopt(3), clock_gettime(3) and sysconf(3)
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#define streq(a,b) (strcmp(a,b)==0)
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "vterm.h"
+
+/*
+ * vterm-parallel [OPTIONS] [FILE]
+ *   Replays the terminal sequences in FILE (or stdin) into a terminal and
+ *   prints the final contents of its screen, as unterm does, but parses the
+ *   input on several threads at once.
+ *
+ *   The input is cut into chunks, just after a newline or before an ESC where
+ *   possible, and each chunk is parsed on its own thread into a journal of
+ *   parser events, on the guess that the parser is idle where it starts. The
+ *   guesses are then checked in order: where the parser of one chunk was not
+ *   idle at its end, the next chunk is parsed again by that same parser. The
+ *   journals are finally replayed in order into the terminal.
+ *
+ * OPTIONS:
+ *   -j THREADS -- number of threads (default: one per CPU)
+ *   -l LINES,
+ *   -c COLS    -- set the size of the emulated terminal
+ *   -s         -- parse sequentially instead, for comparison
+ *   -v         -- print timings and the number of chunks parsed again
+ */
+
+static int rows = 25;
+static int cols = 80;
+
+static int verbose = 0;
+
+static char *slurp(const char *file, size_t *lenp)
+{
+  int fd = 0; // stdin
+  if(file && !streq(file, "-")) {
+    fd = open(file, O_RDONLY);
+    if(fd == -1) {
+      fprintf(stderr, "Cannot open %s - %s\n", file, strerror(errno));
+      exit(1);
+    }
+  }
+
+  size_t len = 0, size = 65536;
+  char *buffer = malloc(size);
+
+  ssize_t got;
+  while((got = read(fd, buffer + len, size - len)) > 0) {
+    len += got;
+    if(len == size)
+      buffer = realloc(buffer, size *= 2);
+  }
+
+  close(fd);
+
+  *lenp = len;
+  return buffer;
+}
+
+struct membuf {
+  char  *bytes;
+  size_t len, size;
+};
+
+static void write_membuf(const char *s, size_t len, void *user)
+{
+  struct membuf *buf = user;
+
+  if(buf->len + len > buf->size) {
+    while(buf->len + len > buf->size)
+      buf->size = buf->size ? buf->size * 2 : 65536;
+    buf->bytes = realloc(buf->bytes, buf->size);
+  }
+
+  memcpy(buf->bytes + buf->len, s, len);
+  buf->len += len;
+}
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static VTerm *new_terminal(void)
+{
+  VTerm *vt = vterm_new(rows, cols);
+  vterm_set_utf8(vt, true);
+
+  VTermScreen *vts = vterm_obtain_screen(vt);
+  vterm_screen_reset(vts, 1);
+
+  return vt;
+}
+
+static void dump_screen(VTerm *vt)
+{
+  VTermScreen *vts = vterm_obtain_screen(vt);
+  char line[1024];
+
+  for(int row = 0; row < rows; row++) {
+    size_t len = vterm_screen_get_text(vts, line, sizeof(line),
+        (VTermRect){ .start_row = row, .end_row = row + 1, .start_col = 0, .end_col = cols });
+
+    /* Trailing blanks are just erased cells */
+    while(len && line[len-1] == ' ')
+      len--;
+    printf("%.*s\n", (int)len, line);
+  }
+}
+
+struct chunk {
+  const char *bytes;
+  size_t len;
+
+  /* The parser that last read this chunk, and what it made of it */
+  VTerm *parser;
+  struct membuf journal;
+  bool idle;
+};
+
+static void parse_chunk(struct chunk *chunk)
+{
+  /* Only the parser is wanted, so keep the output buffers small; the size
+   * matters not */
+  chunk->parser = vterm_build(&(const struct VTermBuilder){
+      .rows = 25,
+      .cols = 80,
+      .outbuffer_len = 64,
+      .tmpbuffer_len = 64,
+    });
+  vterm_set_utf8(chunk->parser, true);
+
+  vterm_journal_start(chunk->parser, write_membuf, &chunk->journal);
+  vterm_input_write(chunk->parser, chunk->bytes, chunk->len);
+  vterm_journal_flush(chunk->parser);
+
+  chunk->idle = vterm_parser_is_idle(chunk->parser);
+}
+
+/* Each thread parses every nth chunk */
+struct worker {
+  struct chunk *chunks;
+  int nchunks;
+  int first, step;
+
+  pthread_t thread;
+  bool started;
+};
+
+static void *work(void *arg)
+{
+  struct worker *worker = arg;
+
+  for(int i = worker->first; i < worker->nchunks; i += worker->step)
+    parse_chunk(&worker->chunks[i]);
+
+  return NULL;
+}
+
+/* Finds where to end a chunk, at or after the given position: just after a
+ * newline if there is one close by, else before an ESC, else right there */
+static size_t find_cut(const char *bytes, size_t len, size_t pos)
+{
+  size_t window = 65536;
+  size_t end = len - pos > window ? pos + window : len;
+
+  const char *nl = memchr(bytes + pos, '\n', end - pos);
+  if(nl)
+    return nl - bytes + 1;
+
+  const char *esc = memchr(bytes + pos, 0x1b, end - pos);
+  if(esc)
+    return esc - bytes;
+
+  return pos;
+}
+
+static void parse_parallel(VTerm *vt, const char *bytes, size_t len, int nthreads)
+{
+  /* A few chunks per thread evens out the work */
+  int nchunks = nthreads > 1 ? nthreads * 4 : 1;
+  struct chunk *chunks = calloc(nchunks, sizeof(chunks[0]));
+
+  size_t pos = 0;
+  int n = 0;
+  for(int i = 0; i < nchunks && pos < len; i++) {
+    size_t end = (i == nchunks - 1) ? len : find_cut(bytes, len, len / nchunks * (i + 1));
+    if(end <= pos)
+      continue;
+
+    chunks[n].bytes = bytes + pos;
+    chunks[n].len   = end - pos;
+    n++;
+    pos = end;
+  }
+
+  double start = now();
+
+  struct worker *workers = calloc(nthreads, sizeof(workers[0]));
+  for(int t = 0; t < nthreads; t++) {
+    workers[t] = (struct worker){
+      .chunks  = chunks,
+      .nchunks = n,
+      .first   = t,
+      .step    = nthreads,
+    };
+    /* Should a thread not start, do its share of the work here instead */
+    workers[t].started = pthread_create(&workers[t].thread, NULL, &work, &workers[t]) == 0;
+    if(!workers[t].started) {
+      if(verbose)
+        fprintf(stderr, "Cannot start thread %d; parsing its chunks on the main thread\n", t);
+      work(&workers[t]);
+    }
+  }
+  for(int t = 0; t < nthreads; t++)
+    if(workers[t].started)
+      pthread_join(workers[t].thread, NULL);
+  free(workers);
+
+  double parsed = now();
+
+  /* Each chunk was parsed as if the parser were idle where it starts. Where
+   * it was not, parse that chunk again with the parser that read the one
+   * before it, which is now in the right state */
+  int redone = 0;
+  for(int i = 1; i < n; i++) {
+    if(chunks[i-1].idle)
+      continue;
+
+    redone++;
+
+    vterm_free(chunks[i].parser);
+    chunks[i].journal.len = 0;
+
+    VTerm *parser = chunks[i].parser = chunks[i-1].parser;
+    chunks[i-1].parser = NULL;
+
+    vterm_journal_stop(parser);
+    vterm_journal_start(parser, write_membuf, &chunks[i].journal);
+    vterm_input_write(parser, chunks[i].bytes, chunks[i].len);
+    vterm_journal_flush(parser);
+
+    chunks[i].idle = vterm_parser_is_idle(parser);
+  }
+
+  double checked = now();
+
+  for(int i = 0; i < n; i++) {
+    size_t done = vterm_journal_replay(vt, chunks[i].journal.bytes, chunks[i].journal.len);
+    if(done < chunks[i].journal.len)
+      fprintf(stderr, "Journal replay of chunk %d stopped at %zu of %zu bytes\n",
+          i, done, chunks[i].journal.len);
+
+    if(chunks[i].parser)
+      vterm_free(chunks[i].parser);
+    free(chunks[i].journal.bytes);
+  }
+
+  double replayed = now();
+
+  if(verbose)
+    fprintf(stderr, "%d chunks on %d threads, %d parsed again\n"
+        "parse %.3fs, check %.3fs, replay %.3fs\n",
+        n, nthreads, redone, parsed - start, checked - parsed, replayed - checked);
+
+  free(chunks);
+}
+
+int main(int argc, char *argv[])
+{
+  int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  int sequential = 0;
+
+  int opt;
+  while((opt = getopt(argc, argv, "j:l:c:sv")) != -1) {
+    switch(opt) {
+      case 'j':
+        nthreads = atoi(optarg);
+        break;
+
+      case 'l':
+        rows = atoi(optarg);
+        if(!rows)
+          rows = 25;
+        break;
+
+      case 'c':
+        cols = atoi(optarg);
+        if(!cols)
+          cols = 80;
+        break;
+
+      case 's':
+        sequential = 1;
+        break;
+
+      case 'v':
+        verbose = 1;
+        break;
+    }
+  }
+
+  if(nthreads < 1)
+    nthreads = 1;
+
+  const char *file = optind < argc ? argv[optind++] : NULL;
+
+  size_t len;
+  char *bytes = slurp(file, &len);
+
+  VTerm *vt = new_terminal();
+
+  if(sequential) {
+    double start = now();
+    vterm_input_write(vt, bytes, len);
+    if(verbose)
+      fprintf(stderr, "sequential %.3fs\n", now() - start);
+  }
+  else
+    parse_parallel(vt, bytes, len, nthreads);
+
+  dump_screen(vt);
+
+  vterm_free(vt);
+  free(bytes);
+
+  return 0;
+}
@@ -0,0 +1,92 @@
+#!/usr/bin/perl
+
+# Builds a two-stage lookup table answering both vterm_unicode_width() and
+# vterm_unicode_is_combining() with a single probe. Each codepoint maps to
+# one byte: bits 0-1 hold width+1 and bit 2 is set for combining characters.
+#
+#   perl gen-unicode-trie.pl src/fullwidth.inc src/combining.inc
+
+use strict;
+use warnings;
+
+my $MAXCP = 0x110000;
+my $SHIFT = 7;
+my $BLOCKSIZE = 1 << $SHIFT;
+
+my ( $fullwidth_file, $combining_file ) = @ARGV;
+defined $combining_file or die "Usage: $0 FULLWIDTH COMBINING\n";
+
+sub read_intervals
+{
+   my ( $path ) = @_;
+   open my $fh, "<", $path or die "Cannot read $path - $!\n";
+   local $/;
+   my $text = <$fh>;
+   my @ret;
+   push @ret, [ hex $1, hex $2 ] while $text =~ m/\{\s*(0x[0-9a-fA-F]+),\s*(0x[0-9a-fA-F]+)\s*\}/g;
+   return @ret;
+}
+
+my @width = ( 1 ) x $MAXCP;
+my @combining = ( 0 ) x $MAXCP;
+
+sub set_range
+{
+   my ( $array, $first, $last, $value ) = @_;
+   $last = $MAXCP - 1 if $last >= $MAXCP;
+   $array->[$_] = $value for $first .. $last;
+}
+
+# The wide ranges hardcoded in mk_wcwidth() in src/unicode.c
+set_range \@width, @$_, 2 for
+   [ 0x1100, 0x115f ], [ 0x2329, 0x232a ], [ 0x2e80, 0x303e ], [ 0x3040, 0xa4cf ],
+   [ 0xac00, 0xd7a3 ], [ 0xf900, 0xfaff ], [ 0xfe10, 0xfe19 ], [ 0xfe30, 0xfe6f ],
+   [ 0xff00, 0xff60 ], [ 0xffe0, 0xffe6 ], [ 0x20000, 0x2fffd ], [ 0x30000, 0x3fffd ];
+
+foreach my $r ( read_intervals $combining_file ) {
+   set_range \@width, @$r, 0;
+   set_range \@combining, @$r, 1;
+}
+
+set_range \@width, 0x01, 0x1f, -1;
+set_range \@width, 0x7f, 0x9f, -1;
+$width[0] = 0;
+
+# vterm_unicode_width() checks the fullwidth table before anything else
+set_range \@width, @$_, 2 for read_intervals $fullwidth_file;
+
+my @blocks;
+my %blockidx;
+my @stage1;
+
+foreach my $blockstart ( map { $_ * $BLOCKSIZE } 0 .. $MAXCP / $BLOCKSIZE - 1 ) {
+   my $block = join ",", map {
+      sprintf "0x%02x", ( $width[$_] + 1 ) | ( $combining[$_] << 2 )
+   } $blockstart .. $blockstart + $BLOCKSIZE - 1;
+
+   $blockidx{$block} //= do { push @blocks, $block; $#blocks };
+   push @stage1, $blockidx{$block};
+}
+
+@blocks <= 256 or die "Too many distinct blocks (" . scalar(@blocks) . ") for an 8-bit index\n";
+
+print "/* generated by gen-unicode-trie.pl - do not edit */\n";
+print "#define UNICODE_TRIE_SHIFT $SHIFT\n";
+print "#define UNICODE_TRIE_LIMIT $MAXCP\n\n";
+
+print "static const uint8_t unicode_trie_index[] = {\n";
+while( my @row = splice @stage1, 0, 16 ) {
+   print "  ", join( ",", @row ), ",\n";
+}
+print "};\n\n";
+
+print "static const uint8_t unicode_trie_data[][$BLOCKSIZE] = {\n";
+foreach my $block ( @blocks ) {
+   my @bytes = split m/,/, $block;
+   print "  {\n";
+   while( my @row = splice @bytes, 0, 16 ) {
+      print "    ", join( ",", @row ), ",\n";
+   }
+   print "  },\n";
+}
+print "};\n";
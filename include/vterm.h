@@ -26,6 +26,7 @@ extern "C" {
 typedef struct VTerm VTerm;
 typedef struct VTermState VTermState;
 typedef struct VTermScreen VTermScreen;
+typedef struct VTermParser VTermParser;
 
 typedef struct {
   int row;
@@ -260,6 +261,7 @@ typedef enum {
   VTERM_PROP_CURSORSHAPE,       // number
   VTERM_PROP_MOUSE,             // number
   VTERM_PROP_FOCUSREPORT,       // bool
+  VTERM_PROP_SYNCOUTPUT,        // bool
 
   VTERM_N_PROPS
 } VTermProp;
@@ -297,6 +299,22 @@ typedef struct {
   unsigned int    dhl:2;             /* DECDHL double-height line (1=top 2=bottom) */
 } VTermGlyphInfo;
 
+/* The complete pen, as given to the 'setpen' state callback */
+typedef struct VTermPen {
+  VTermColor fg;
+  VTermColor bg;
+  unsigned int bold:1;
+  unsigned int underline:2;
+  unsigned int italic:1;
+  unsigned int blink:1;
+  unsigned int reverse:1;
+  unsigned int conceal:1;
+  unsigned int strike:1;
+  unsigned int font:4; /* To store 0-9 */
+  unsigned int small:1;
+  unsigned int baseline:2;
+} VTermPen;
+
 typedef struct {
   unsigned int    doublewidth:1;     /* DECDWL or DECDHL line */
   unsigned int    doubleheight:2;    /* DECDHL line (1=top 2=bottom) */
@@ -333,6 +351,15 @@ struct VTermBuilder {
   /* Override default sizes for various structures */
   size_t outbuffer_len;  /* default: 4096 */
   size_t tmpbuffer_len;  /* default: 4096 */
+
+  /* Maximum payload size of each type of string command. Only the first
+   * so many bytes of a longer one reach the parser callbacks, as if it had
+   * been cancelled there; the rest is discarded unseen */
+  size_t osc_limit;      /* default: 0, unlimited */
+  size_t dcs_limit;      /* default: 0, unlimited */
+  size_t apc_limit;      /* default: 0, unlimited */
+  size_t pm_limit;       /* default: 0, unlimited */
+  size_t sos_limit;      /* default: 0, unlimited */
 };
 
 VTerm *vterm_build(const struct VTermBuilder *builder);
@@ -420,6 +447,133 @@ void *vterm_parser_get_cbdata(VTerm *vt);
  */
 void vterm_parser_set_emit_nul(VTerm *vt, bool emit);
 
+/* True if the parser is not part way through any sequence or string, so
+ * that whatever is written next is parsed as if it began a new stream
+ */
+bool vterm_parser_is_idle(VTerm *vt);
+
+/* The number of string command bytes discarded for going over the limits
+ * given to vterm_build()
+ */
+size_t vterm_parser_get_string_discarded(const VTerm *vt);
+
+/* Normally the string commands (OSC, DCS, APC, PM and SOS) reach the parser
+ * callbacks in fragments, as they arrive. With a non-zero size set here,
+ * each is instead given whole as one fragment with both initial and final
+ * set; straight from the input if it all arrives in one write, else gathered
+ * in a buffer of up to max_bytes. A string longer than that, or cut short by
+ * its limit, is passed on as far as it was gathered and then continues in
+ * fragments as usual. Controls within a string are still given as they are
+ * met, so come before the string itself. 0 restores the normal behaviour;
+ * either way, a string already begun carries on as it started.
+ */
+void vterm_parser_set_whole_strings(VTerm *vt, size_t max_bytes);
+
+/* Enables a small cache of recently seen CSI sequences, so that one repeated
+ * byte-for-byte (such as a common SGR or cursor movement) is dispatched
+ * without parsing its arguments again. Only sequences arriving whole within
+ * one write are cached. The stats count lookups since it was enabled
+ */
+void vterm_parser_set_csi_cache(VTerm *vt, bool enabled);
+void vterm_parser_get_csi_cache_stats(VTerm *vt, unsigned long *hits, unsigned long *misses);
+
+/* As an alternative to the callbacks, the parser can be given a buffer with
+ * vterm_parser_feed() and then asked for one event at a time. A fed buffer
+ * produces the same events as the callbacks would see for one write of it,
+ * except that text is always given as the whole run of printable bytes. The
+ * buffer must stay valid until vterm_parser_next_event() returns false, and
+ * any pointers in an event are only valid until the next call to it.
+ */
+typedef enum {
+  VTERM_PARSER_EVENT_TEXT,
+  VTERM_PARSER_EVENT_CONTROL,
+  VTERM_PARSER_EVENT_ESCAPE,
+  VTERM_PARSER_EVENT_CSI,
+  VTERM_PARSER_EVENT_OSC,
+  VTERM_PARSER_EVENT_DCS,
+  VTERM_PARSER_EVENT_APC,
+  VTERM_PARSER_EVENT_PM,
+  VTERM_PARSER_EVENT_SOS,
+} VTermParserEventType;
+
+typedef struct {
+  VTermParserEventType type;
+  union {
+    struct {
+      const char *bytes;
+      size_t len;
+    } text, escape;
+    unsigned char control;
+    struct {
+      const char *leader;   /* NULL if none */
+      const long *args;
+      int argcount;
+      const char *intermed; /* NULL if none */
+      char command;
+    } csi;
+    struct {
+      int command;
+      VTermStringFragment frag;
+    } osc;
+    struct {
+      const char *command;
+      size_t commandlen;
+      VTermStringFragment frag;
+    } dcs;
+    VTermStringFragment frag; /* APC, PM, SOS */
+  } v;
+} VTermParserEvent;
+
+void vterm_parser_feed(VTerm *vt, const char *bytes, size_t len);
+bool vterm_parser_next_event(VTerm *vt, VTermParserEvent *ev);
+
+/* A parser can also be created on its own, for when only the parser events
+ * are wanted. It keeps no terminal state or output buffers, so it is much
+ * smaller than a VTerm. Its callbacks behave just as those given to
+ * vterm_parser_set_callbacks(); resize is never called.
+ */
+struct VTermParserBuilder {
+  int ver; /* currently unused but reserved for some sort of ABI version flag */
+
+  const VTermAllocatorFunctions *allocator;
+  void *allocdata;
+
+  const VTermParserCallbacks *callbacks;
+  void *cbdata;
+
+  bool utf8;
+  bool emit_nul;
+
+  /* As for VTermBuilder */
+  size_t osc_limit;
+  size_t dcs_limit;
+  size_t apc_limit;
+  size_t pm_limit;
+  size_t sos_limit;
+
+  /* As for vterm_parser_set_whole_strings() */
+  size_t whole_string_max;
+};
+
+VTermParser *vterm_parser_build(const struct VTermParserBuilder *builder);
+void         vterm_parser_free(VTermParser *parser);
+
+size_t vterm_parser_write(VTermParser *parser, const char *bytes, size_t len);
+
+/* While a journal is started, every parser event is also written out in a
+ * compact binary form through the given function, before being passed on to
+ * the parser callbacks as usual. Replaying a journal sends those events to
+ * the parser callbacks again without the input bytes being parsed. Replay
+ * consumes whole records only, returning how many bytes it used; any partial
+ * record left at the end should be passed again along with what follows it.
+ */
+#define VTERM_JOURNAL_VERSION 1
+
+void   vterm_journal_start(VTerm *vt, VTermOutputCallback *func, void *user);
+void   vterm_journal_flush(VTerm *vt);
+void   vterm_journal_stop(VTerm *vt);
+size_t vterm_journal_replay(VTerm *vt, const char *bytes, size_t len);
+
 // -----------
 // State layer
 // -----------
@@ -437,6 +591,18 @@ typedef struct {
   int (*resize)(int rows, int cols, VTermStateFields *fields, void *user);
   int (*setlineinfo)(int row, const VTermLineInfo *newinfo, const VTermLineInfo *oldinfo, void *user);
   int (*sb_clear)(void *user);
+  /* Optional batched form of 'putglyph'. When set, it is preferred for runs
+   * of glyphs that are printed consecutively on one row with the same pen,
+   * each at least one column wide. The first glyph goes at 'pos' and each
+   * following one directly after the previous. If it returns 0, the glyphs
+   * are passed to 'putglyph' one at a time instead.
+   */
+  int (*putglyphs)(const VTermGlyphInfo info[], int count, VTermPos pos, void *user);
+  /* Optional whole-pen form of 'setpenattr'. When set, it is called instead,
+   * with the complete new pen, once for each SGR sequence, pen reset or pen
+   * restore that changes anything; and once when the callbacks are set.
+   */
+  int (*setpen)(const VTermPen *pen, void *user);
 } VTermStateCallbacks;
 
 typedef struct {
@@ -462,6 +628,22 @@ void *vterm_state_get_cbdata(VTermState *state);
 void  vterm_state_set_unrecognised_fallbacks(VTermState *state, const VTermStateFallbacks *fallbacks, void *user);
 void *vterm_state_get_unrecognised_fbdata(VTermState *state);
 
+/* Handlers can be registered for particular CSI sequences (by their leader,
+ * intermediates and final byte; NULL or "" for none), OSC command numbers,
+ * or DCS command bytes. A registered handler is looked up before any
+ * built-in handling of the sequence and is called with the same arguments
+ * as the matching fallback. If it returns 0 the sequence is handled as if
+ * it had not been registered. Registering a NULL handler removes one. These
+ * return 0 if the key is too long or memory could not be allocated.
+ */
+typedef int VTermStateCSIHandler(const char *leader, const long args[], int argcount, const char *intermed, char command, void *user);
+typedef int VTermStateOSCHandler(int command, VTermStringFragment frag, void *user);
+typedef int VTermStateDCSHandler(const char *command, size_t commandlen, VTermStringFragment frag, void *user);
+
+int vterm_state_register_csi(VTermState *state, const char *leader, const char *intermed, char command, VTermStateCSIHandler *handler, void *user);
+int vterm_state_register_osc(VTermState *state, int command, VTermStateOSCHandler *handler, void *user);
+int vterm_state_register_dcs(VTermState *state, const char *command, size_t commandlen, VTermStateDCSHandler *handler, void *user);
+
 void vterm_state_reset(VTermState *state, int hard);
 void vterm_state_get_cursorpos(const VTermState *state, VTermPos *cursorpos);
 void vterm_state_get_default_colors(const VTermState *state, VTermColor *default_fg, VTermColor *default_bg);
@@ -531,6 +713,57 @@ typedef struct {
   VTermColor fg, bg;
 } VTermScreenCell;
 
+/* A screen row in packed form, as given to sb_pushline_raw. The header is
+ * followed immediately by nruns VTermScreenRowRun structures, which cover the
+ * columns from left to right, and then by textlen bytes of text. The text
+ * holds each column's characters as UTF-8 in turn, except that an erased cell
+ * is a single VTERM_ROW_TEXT_ERASED byte, the right half of a wide character
+ * is a VTERM_ROW_TEXT_WIDE_GAP byte, and each combining character is preceded
+ * by a VTERM_ROW_TEXT_COMBINING byte. Erased cells at the end of the row in
+ * the same run as the last column are left out of the text.
+ *
+ * The row holds no pointers, so its vterm_screen_row_size() bytes can be
+ * copied or compressed as they are and read back later with the functions
+ * below.
+ */
+typedef struct {
+  int cols;
+  int nruns;
+  int textlen;
+} VTermScreenRow;
+
+typedef struct {
+  VTermScreenCellAttrs attrs;
+  VTermColor fg, bg;
+  int cells;
+} VTermScreenRowRun;
+
+#define VTERM_ROW_TEXT_ERASED    0x00
+#define VTERM_ROW_TEXT_WIDE_GAP  0x01
+#define VTERM_ROW_TEXT_COMBINING 0x02
+
+typedef struct {
+  const VTermScreenRow *row;
+  int run;
+  int col;
+} VTermScreenRowIter;
+
+size_t                   vterm_screen_row_size(const VTermScreenRow *row);
+const VTermScreenRowRun *vterm_screen_row_runs(const VTermScreenRow *row);
+const unsigned char     *vterm_screen_row_text(const VTermScreenRow *row);
+
+/* Steps through the runs of a row, returning NULL after the last one. The
+ * run covers the columns from *start_col up to but not including *end_col;
+ * either may be NULL.
+ */
+void                     vterm_screen_row_iter_init(VTermScreenRowIter *iter, const VTermScreenRow *row);
+const VTermScreenRowRun *vterm_screen_row_iter_next(VTermScreenRowIter *iter, int *start_col, int *end_col);
+
+/* Expands a row into cols cells, as sb_pushline would have given them.
+ * Columns beyond the row's own width are erased, in the last run's attributes.
+ */
+void vterm_screen_row_get_cells(const VTermScreenRow *row, VTermScreenCell cells[], int cols);
+
 typedef struct {
   int (*damage)(VTermRect rect, void *user);
   int (*moverect)(VTermRect dest, VTermRect src, void *user);
@@ -541,6 +774,17 @@ typedef struct {
   int (*sb_pushline)(int cols, const VTermScreenCell *cells, void *user);
   int (*sb_popline)(int cols, VTermScreenCell *cells, void *user);
   int (*sb_clear)(void* user);
+  /* Optional; used by VTERM_DAMAGE_REGION to deliver all the damage collected
+   * since the last flush in one go, as a set of disjoint rectangles ordered
+   * by row then column. If it is not set, or returns 0, each rectangle is
+   * passed to 'damage' in turn.
+   */
+  int (*damage_region)(const VTermRect rects[], int count, void *user);
+  /* Optional; if set, is used in preference to sb_pushline. The row is only
+   * valid for the duration of the call. If it returns 0, the line is passed
+   * to sb_pushline instead, if that is set.
+   */
+  int (*sb_pushline_raw)(const VTermScreenRow *row, void *user);
 } VTermScreenCallbacks;
 
 VTermScreen *vterm_obtain_screen(VTerm *vt);
@@ -558,11 +802,29 @@ void vterm_screen_enable_reflow(VTermScreen *screen, bool reflow);
 
 void vterm_screen_enable_altscreen(VTermScreen *screen, int altscreen);
 
+/* Keeps lines scrolled off the top of the primary screen inside libvterm, in
+ * a compact run-length form, using at most max_bytes of memory; the oldest
+ * lines are dropped to stay within it. While enabled, it takes the place of
+ * the sb_pushline, sb_popline and sb_clear callbacks. A max_bytes of 0
+ * disables it and frees the stored lines.
+ *
+ * Line 0 is the most recently scrolled-off line. get_scrollback_cells() fills
+ * in cols cells and returns the width the line had when it was stored, or 0
+ * if there is no such line. get_scrollback_text() behaves like
+ * vterm_screen_get_text() on that line, and does not NUL-terminate either.
+ */
+void   vterm_screen_enable_scrollback(VTermScreen *screen, size_t max_bytes);
+int    vterm_screen_get_scrollback_lines(const VTermScreen *screen);
+size_t vterm_screen_get_scrollback_bytes(const VTermScreen *screen);
+int    vterm_screen_get_scrollback_cells(const VTermScreen *screen, int line, VTermScreenCell cells[], int cols);
+size_t vterm_screen_get_scrollback_text(const VTermScreen *screen, int line, char *str, size_t len);
+
 typedef enum {
   VTERM_DAMAGE_CELL,    /* every cell */
   VTERM_DAMAGE_ROW,     /* entire rows */
   VTERM_DAMAGE_SCREEN,  /* entire screen */
   VTERM_DAMAGE_SCROLL,  /* entire screen + scrollrect */
+  VTERM_DAMAGE_REGION,  /* set of disjoint rectangles, emitted at flush */
 
   VTERM_N_DAMAGES
 } VTermDamageSize;
@@ -570,6 +832,40 @@ typedef enum {
 void vterm_screen_flush_damage(VTermScreen *screen);
 void vterm_screen_set_damage_merge(VTermScreen *screen, VTermDamageSize size);
 
+/* While the application holds DEC mode 2026 (synchronized output) set, the
+ * screen holds back its damage, moverect and movecursor callbacks. When the
+ * mode is reset, everything changed meanwhile is reported as one damage
+ * rectangle, merged and flushed as the damage merge size dictates, followed by
+ * at most one movecursor. vterm_screen_flush_damage() does not end a held
+ * update. The generation counter for vterm_screen_get_dirty_rows() still
+ * advances meanwhile.
+ *
+ * libvterm keeps no clock, so the host reports the passing of time by calling
+ * vterm_screen_advance_time(); an update held back for the timeout (default
+ * 1000 msec; 0 meaning forever) is delivered as if the mode had been reset.
+ */
+void vterm_screen_set_sync_timeout(VTermScreen *screen, int msec);
+void vterm_screen_advance_time(VTermScreen *screen, int msec);
+
+/* A polling alternative to the 'damage' callback. Every change to the screen
+ * advances a generation counter, and each row remembers the generation of
+ * its latest change along with the span of columns changed.
+ *
+ * vterm_screen_get_dirty_rows() fills in up to maxrows entries of rows[], in
+ * row order, for the rows changed after generation since_gen. It returns the
+ * total number of such rows, which may be more than maxrows. Passing the
+ * value vterm_screen_get_generation() returned at the previous poll gives
+ * the tightest spans; for older generations, whole rows are reported.
+ */
+typedef struct {
+  int row;
+  int start_col;
+  int end_col;
+} VTermDirtyRow;
+
+uint64_t vterm_screen_get_generation(const VTermScreen *screen);
+int      vterm_screen_get_dirty_rows(VTermScreen *screen, uint64_t since_gen, VTermDirtyRow rows[], int maxrows);
+
 void   vterm_screen_reset(VTermScreen *screen, int hard);
 
 /* Neither of these functions NUL-terminate the buffer */
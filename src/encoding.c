@@ -1,11 +1,61 @@
 #include "vterm_internal.h"
 
+#include <string.h>
+
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
+
 #define UNICODE_INVALID 0xFFFD
 
 #if defined(DEBUG) && DEBUG > 1
 # define DEBUG_PRINT_UTF8
 #endif
 
+/* Returns the length of the run of printable ASCII bytes (0x20 to 0x7e) at
+ * the start of the buffer. These make up the bulk of most terminal output, so
+ * the decoders use this to convert whole runs at once rather than going
+ * through their per-byte logic. Callers limit len to the space left for
+ * output, so that a long run is never scanned further than it can be used.
+ */
+static size_t printable_ascii_run(const char bytes[], size_t len)
+{
+  size_t i = 0;
+
+#ifdef __SSE2__
+  const __m128i below = _mm_set1_epi8(0x1f);
+  const __m128i above = _mm_set1_epi8(0x7f);
+
+  for(; i + 16 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(bytes + i));
+    /* Signed comparisons, so bytes >= 0x80 fail the lower bound as well */
+    __m128i ok = _mm_and_si128(_mm_cmpgt_epi8(v, below), _mm_cmplt_epi8(v, above));
+    if(_mm_movemask_epi8(ok) != 0xffff)
+      break;
+  }
+#endif
+
+#define BYTEWISE(b)  ((uint64_t)0x0101010101010101 * (b))
+  for(; i + 8 <= len; i += 8) {
+    uint64_t x;
+    memcpy(&x, bytes + i, 8);
+
+    if((x & BYTEWISE(0x80)) ||                         // any byte >= 0x80
+       ((x - BYTEWISE(0x20)) & ~x & BYTEWISE(0x80)) || // any byte < 0x20
+       ((x + BYTEWISE(0x01)) & BYTEWISE(0x80)))         // any byte == 0x7f
+      break;
+  }
+#undef BYTEWISE
+
+  for(; i < len; i++) {
+    unsigned char c = bytes[i];
+    if(c < 0x20 || c >= 0x7f)
+      break;
+  }
+
+  return i;
+}
+
 struct UTF8DecoderData {
   // number of bytes remaining in this codepoint
   int bytes_remaining;
@@ -17,6 +67,105 @@ struct UTF8DecoderData {
   int this_cp;
 };
 
+static inline uint32_t utf8_checked(uint32_t c, uint32_t min)
+{
+  if(c < min ||                     // overlong
+     (c >= 0xD800 && c <= 0xDFFF) ||
+     c == 0xFFFE ||
+     c == 0xFFFF)
+    return UNICODE_INVALID;
+
+  return c;
+}
+
+/* Decodes printable ASCII and complete 2-, 3- and 4-byte sequences from the
+ * start of the buffer, for when no sequence is in progress. It stops at
+ * anything the full state machine in decode_utf8 has to see: C0 and DEL,
+ * stray continuation bytes, 5- and 6-byte leaders, and sequences that are
+ * interrupted or cut short by the end of the buffer. Whatever it does decode
+ * comes out exactly as the state machine would have produced it, overlongs
+ * and surrogates included. Returns the number of bytes consumed.
+ */
+static size_t decode_utf8_block(uint32_t cp[], int *cpi, int cplen,
+                                const unsigned char s[], size_t len)
+{
+  size_t i = 0;
+  int n = *cpi;
+
+  while(i < len && n < cplen) {
+    unsigned char c = s[i];
+
+#ifdef __SSE2__
+    /* Runs of same-length sequences, as typical of Cyrillic, CJK or emoji
+     * text, are recognised a whole 16-byte block at a time */
+    if(c >= 0xc0 && i + 16 <= len && n + 8 <= cplen) {
+      __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+      /* Signed comparison; only 0x80 to 0xbf are below 0xc0 */
+      int cont  = _mm_movemask_epi8(_mm_cmplt_epi8(v, _mm_set1_epi8((char)0xc0)));
+      int lead2 = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(v, _mm_set1_epi8((char)0xe0)),
+                                                   _mm_set1_epi8((char)0xc0)));
+      int lead3 = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(v, _mm_set1_epi8((char)0xf0)),
+                                                   _mm_set1_epi8((char)0xe0)));
+      int lead4 = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(v, _mm_set1_epi8((char)0xf8)),
+                                                   _mm_set1_epi8((char)0xf0)));
+
+      if(lead3 == 0x1249 && (cont & 0x7fff) == 0x6db6) {
+        for(int k = 0; k < 15; k += 3)
+          cp[n++] = utf8_checked((s[i+k] & 0x0f) << 12 | (s[i+k+1] & 0x3f) << 6 | (s[i+k+2] & 0x3f), 0x0800);
+        i += 15;
+        continue;
+      }
+      if(lead2 == 0x5555 && cont == 0xaaaa) {
+        for(int k = 0; k < 16; k += 2)
+          cp[n++] = utf8_checked((s[i+k] & 0x1f) << 6 | (s[i+k+1] & 0x3f), 0x0080);
+        i += 16;
+        continue;
+      }
+      if(lead4 == 0x1111 && cont == 0xeeee) {
+        for(int k = 0; k < 16; k += 4)
+          cp[n++] = utf8_checked((s[i+k] & 0x07) << 18 | (s[i+k+1] & 0x3f) << 12 |
+                                 (s[i+k+2] & 0x3f) << 6 | (s[i+k+3] & 0x3f), 0x10000);
+        i += 16;
+        continue;
+      }
+    }
+#endif
+
+    if(c >= 0x20 && c < 0x7f) {
+      size_t room = cplen - n;
+      size_t run = printable_ascii_run((const char *)s + i, len - i < room ? len - i : room);
+
+      for(size_t k = 0; k < run; k++)
+        cp[n++] = s[i + k];
+      i += run;
+    }
+    else if(c >= 0xc0 && c < 0xe0) {
+      if(i + 2 > len || (s[i+1] & 0xc0) != 0x80)
+        break;
+      cp[n++] = utf8_checked((c & 0x1f) << 6 | (s[i+1] & 0x3f), 0x0080);
+      i += 2;
+    }
+    else if(c >= 0xe0 && c < 0xf0) {
+      if(i + 3 > len || (s[i+1] & 0xc0) != 0x80 || (s[i+2] & 0xc0) != 0x80)
+        break;
+      cp[n++] = utf8_checked((c & 0x0f) << 12 | (s[i+1] & 0x3f) << 6 | (s[i+2] & 0x3f), 0x0800);
+      i += 3;
+    }
+    else if(c >= 0xf0 && c < 0xf8) {
+      if(i + 4 > len || (s[i+1] & 0xc0) != 0x80 || (s[i+2] & 0xc0) != 0x80 || (s[i+3] & 0xc0) != 0x80)
+        break;
+      cp[n++] = utf8_checked((c & 0x07) << 18 | (s[i+1] & 0x3f) << 12 |
+                             (s[i+2] & 0x3f) << 6 | (s[i+3] & 0x3f), 0x10000);
+      i += 4;
+    }
+    else
+      break;
+  }
+
+  *cpi = n;
+  return i;
+}
+
 static void init_utf8(VTermEncoding *enc, void *data_)
 {
   struct UTF8DecoderData *data = data_;
@@ -42,6 +191,14 @@ static void decode_utf8(VTermEncoding *enc, void *data_,
     printf(" pos=%zd c=%02x rem=%d\n", *pos, c, data->bytes_remaining);
 #endif
 
+    if(c >= 0xc0 && !data->bytes_remaining) {
+      size_t done = decode_utf8_block(cp, cpi, cplen, (const unsigned char *)bytes + *pos, bytelen - *pos);
+      if(done) {
+        *pos += done - 1;
+        continue;
+      }
+    }
+
     if(c < 0x20) // C0
       return;
 
@@ -54,6 +211,14 @@ static void decode_utf8(VTermEncoding *enc, void *data_,
       printf(" UTF-8 char: U+%04x\n", c);
 #endif
       data->bytes_remaining = 0;
+
+      /* Take the rest of any printable ASCII run following it in one go */
+      size_t room = cplen - *cpi;
+      size_t run = printable_ascii_run(bytes + *pos + 1, bytelen - *pos - 1 < room ? bytelen - *pos - 1 : room);
+
+      for(size_t i = 1; i <= run; i++)
+        cp[(*cpi)++] = (unsigned char)bytes[*pos + i];
+      *pos += run;
     }
 
     else if(c == 0x7f) // DEL
@@ -165,6 +330,15 @@ static void decode_usascii(VTermEncoding *enc, void *data,
 {
   int is_gr = bytes[*pos] & 0x80;
 
+  if(!is_gr) {
+    size_t room = cplen - *cpi;
+    size_t run = printable_ascii_run(bytes + *pos, bytelen - *pos < room ? bytelen - *pos : room);
+
+    for(size_t i = 0; i < run; i++)
+      cp[(*cpi)++] = (unsigned char)bytes[*pos + i];
+    *pos += run;
+  }
+
   for(; *pos < bytelen && *cpi < cplen; (*pos)++) {
     unsigned char c = bytes[*pos] ^ is_gr;
 
@@ -0,0 +1,536 @@
+#include "vterm_internal.h"
+
+#include <stdio.h>
+#include <string.h>
+
+/* The journal starts with a header record, 'V' 'T' 'J' version, and then has
+ * one record per parser event. Each record is a type byte followed by its
+ * fields; numbers are stored as unsigned LEB128 varints, and byte strings as
+ * a varint length then the bytes themselves.
+ *
+ *   'T' bytes                                text
+ *   'C' byte                                 control
+ *   'E' bytes                                escape, intermediates and final
+ *   'S' command n [leader] [intermed] arg*   CSI
+ *   'O' command+1 flags bytes                OSC fragment
+ *   'D' command flags bytes                  DCS fragment
+ *   'A' flags bytes                          APC fragment
+ *   'P' flags bytes                          PM fragment
+ *   'X' flags bytes                          SOS fragment
+ *   'Z' rows cols                            resize
+ *
+ * String fragment flags are bit 0 for initial and bit 1 for final. The CSI
+ * byte n holds the argument count in its low 5 bits, then a bit each to say
+ * the leader and intermediates follow. Each argument is stored as 0 if
+ * missing or its value plus 1 otherwise, shifted up one bit to make room for
+ * the CSI_ARG_FLAG_MORE bit.
+ */
+
+#define JOURNAL_BUFFER_SIZE 4096
+
+#define JOURNAL_ARG_MORE 0x01
+
+#define JOURNAL_CSI_ARGCOUNT 0x1f
+#define JOURNAL_CSI_LEADER   0x20
+#define JOURNAL_CSI_INTERMED 0x40
+
+static void journal_put(VTerm *vt, const char *bytes, size_t len)
+{
+  if(vt->journal.buffer_cur + len > JOURNAL_BUFFER_SIZE)
+    vterm_journal_flush(vt);
+
+  if(len > JOURNAL_BUFFER_SIZE) {
+    (*vt->journal.func)(bytes, len, vt->journal.user);
+    return;
+  }
+
+  memcpy(vt->journal.buffer + vt->journal.buffer_cur, bytes, len);
+  vt->journal.buffer_cur += len;
+}
+
+static void journal_put_varint(VTerm *vt, unsigned long val)
+{
+  char bytes[(sizeof(val) * 8 + 6) / 7];
+  size_t len = 0;
+
+  while(val >= 0x80) {
+    bytes[len++] = 0x80 | (val & 0x7f);
+    val >>= 7;
+  }
+  bytes[len++] = val;
+
+  journal_put(vt, bytes, len);
+}
+
+static void journal_put_bytes(VTerm *vt, const char *bytes, size_t len)
+{
+  journal_put_varint(vt, len);
+  journal_put(vt, bytes, len);
+}
+
+static void journal_put_type(VTerm *vt, char type)
+{
+  journal_put(vt, &type, 1);
+}
+
+static void journal_put_frag(VTerm *vt, VTermStringFragment frag)
+{
+  journal_put_varint(vt, frag.initial | frag.final << 1);
+  journal_put_bytes(vt, frag.str, frag.len);
+}
+
+static int journal_text(const char bytes[], size_t len, void *user)
+{
+  VTerm *vt = user;
+  const VTermParserCallbacks *cbs = vt->journal.callbacks;
+  size_t eaten = 0;
+
+  if(cbs && cbs->text)
+    eaten = (*cbs->text)(bytes, len, vt->journal.cbdata);
+  else
+    /* Nobody downstream to say how much they took, so take the whole run up
+     * to the next control */
+    while(eaten < len) {
+      unsigned char b = bytes[eaten];
+      if(b < 0x20 || b == 0x7f || (b >= 0x80 && b < 0xa0 && !vt->mode.utf8))
+        break;
+      eaten++;
+    }
+
+  if(eaten) {
+    journal_put_type(vt, 'T');
+    journal_put_bytes(vt, bytes, eaten);
+  }
+
+  return eaten;
+}
+
+static int journal_control(unsigned char control, void *user)
+{
+  VTerm *vt = user;
+  const VTermParserCallbacks *cbs = vt->journal.callbacks;
+
+  journal_put_type(vt, 'C');
+  journal_put(vt, (char *)&control, 1);
+
+  if(cbs && cbs->control)
+    return (*cbs->control)(control, vt->journal.cbdata);
+  return 1;
+}
+
+static int journal_escape(const char bytes[], size_t len, void *user)
+{
+  VTerm *vt = user;
+  const VTermParserCallbacks *cbs = vt->journal.callbacks;
+
+  journal_put_type(vt, 'E');
+  journal_put_bytes(vt, bytes, len);
+
+  if(cbs && cbs->escape)
+    return (*cbs->escape)(bytes, len, vt->journal.cbdata);
+  return 1;
+}
+
+static int journal_csi(const char *leader, const long args[], int argcount, const char *intermed, char command, void *user)
+{
+  VTerm *vt = user;
+  const VTermParserCallbacks *cbs = vt->journal.callbacks;
+
+  char n = argcount;
+  if(leader && leader[0])
+    n |= JOURNAL_CSI_LEADER;
+  if(intermed && intermed[0])
+    n |= JOURNAL_CSI_INTERMED;
+
+  journal_put_type(vt, 'S');
+  journal_put(vt, &command, 1);
+  journal_put(vt, &n, 1);
+  if(n & JOURNAL_CSI_LEADER)
+    journal_put_bytes(vt, leader, strlen(leader));
+  if(n & JOURNAL_CSI_INTERMED)
+    journal_put_bytes(vt, intermed, strlen(intermed));
+
+  for(int i = 0; i < argcount; i++) {
+    unsigned long val = CSI_ARG_IS_MISSING(args[i]) ? 0 : CSI_ARG(args[i]) + 1;
+    journal_put_varint(vt, val << 1 | (CSI_ARG_HAS_MORE(args[i]) ? JOURNAL_ARG_MORE : 0));
+  }
+
+  if(cbs && cbs->csi)
+    return (*cbs->csi)(leader, args, argcount, intermed, command, vt->journal.cbdata);
+  return 1;
+}
+
+static int journal_osc(int command, VTermStringFragment frag, void *user)
+{
+  VTerm *vt = user;
+  const VTermParserCallbacks *cbs = vt->journal.callbacks;
+
+  journal_put_type(vt, 'O');
+  journal_put_varint(vt, command + 1);
+  journal_put_frag(vt, frag);
+
+  if(cbs && cbs->osc)
+    return (*cbs->osc)(command, frag, vt->journal.cbdata);
+  return 1;
+}
+
+static int journal_dcs(const char *command, size_t commandlen, VTermStringFragment frag, void *user)
+{
+  VTerm *vt = user;
+  const VTermParserCallbacks *cbs = vt->journal.callbacks;
+
+  journal_put_type(vt, 'D');
+  journal_put_bytes(vt, command, commandlen);
+  journal_put_frag(vt, frag);
+
+  if(cbs && cbs->dcs)
+    return (*cbs->dcs)(command, commandlen, frag, vt->journal.cbdata);
+  return 1;
+}
+
+static int journal_apc(VTermStringFragment frag, void *user)
+{
+  VTerm *vt = user;
+  const VTermParserCallbacks *cbs = vt->journal.callbacks;
+
+  journal_put_type(vt, 'A');
+  journal_put_frag(vt, frag);
+
+  if(cbs && cbs->apc)
+    return (*cbs->apc)(frag, vt->journal.cbdata);
+  return 1;
+}
+
+static int journal_pm(VTermStringFragment frag, void *user)
+{
+  VTerm *vt = user;
+  const VTermParserCallbacks *cbs = vt->journal.callbacks;
+
+  journal_put_type(vt, 'P');
+  journal_put_frag(vt, frag);
+
+  if(cbs && cbs->pm)
+    return (*cbs->pm)(frag, vt->journal.cbdata);
+  return 1;
+}
+
+static int journal_sos(VTermStringFragment frag, void *user)
+{
+  VTerm *vt = user;
+  const VTermParserCallbacks *cbs = vt->journal.callbacks;
+
+  journal_put_type(vt, 'X');
+  journal_put_frag(vt, frag);
+
+  if(cbs && cbs->sos)
+    return (*cbs->sos)(frag, vt->journal.cbdata);
+  return 1;
+}
+
+static int journal_resize(int rows, int cols, void *user)
+{
+  VTerm *vt = user;
+  const VTermParserCallbacks *cbs = vt->journal.callbacks;
+
+  journal_put_type(vt, 'Z');
+  journal_put_varint(vt, rows);
+  journal_put_varint(vt, cols);
+
+  if(cbs && cbs->resize)
+    return (*cbs->resize)(rows, cols, vt->journal.cbdata);
+  return 1;
+}
+
+static const VTermParserCallbacks journal_callbacks = {
+  .text    = journal_text,
+  .control = journal_control,
+  .escape  = journal_escape,
+  .csi     = journal_csi,
+  .osc     = journal_osc,
+  .dcs     = journal_dcs,
+  .apc     = journal_apc,
+  .pm      = journal_pm,
+  .sos     = journal_sos,
+  .resize  = journal_resize,
+};
+
+void vterm_journal_start(VTerm *vt, VTermOutputCallback *func, void *user)
+{
+  if(vt->journal.func)
+    vterm_journal_stop(vt);
+
+  vt->journal.func = func;
+  vt->journal.user = user;
+
+  vt->journal.callbacks = vt->parser.callbacks;
+  vt->journal.cbdata    = vt->parser.cbdata;
+
+  vt->parser.callbacks = &journal_callbacks;
+  vt->parser.cbdata    = vt;
+
+  vt->journal.buffer = vterm_allocator_malloc(vt, JOURNAL_BUFFER_SIZE);
+  vt->journal.buffer_cur = 0;
+
+  char header[] = { 'V', 'T', 'J', VTERM_JOURNAL_VERSION };
+  journal_put(vt, header, sizeof(header));
+}
+
+void vterm_journal_flush(VTerm *vt)
+{
+  if(!vt->journal.func || !vt->journal.buffer_cur)
+    return;
+
+  (*vt->journal.func)(vt->journal.buffer, vt->journal.buffer_cur, vt->journal.user);
+  vt->journal.buffer_cur = 0;
+}
+
+void vterm_journal_stop(VTerm *vt)
+{
+  if(!vt->journal.func)
+    return;
+
+  vterm_journal_flush(vt);
+
+  vt->parser.callbacks = vt->journal.callbacks;
+  vt->parser.cbdata    = vt->journal.cbdata;
+
+  vterm_allocator_free(vt, vt->journal.buffer);
+  vt->journal.buffer = NULL;
+
+  vt->journal.func = NULL;
+}
+
+/* Reading a record stops with false at the end of the buffer, or at anything
+ * that doesn't make sense */
+typedef struct {
+  const char *bytes;
+  size_t len, pos;
+} JournalReader;
+
+static bool journal_get_varint(JournalReader *r, unsigned long *val)
+{
+  *val = 0;
+  for(int shift = 0; shift < sizeof(*val) * 8; shift += 7) {
+    if(r->pos == r->len)
+      return false;
+
+    unsigned char b = r->bytes[r->pos++];
+    *val |= (unsigned long)(b & 0x7f) << shift;
+    if(!(b & 0x80))
+      return true;
+  }
+
+  return false;
+}
+
+static bool journal_get_bytes(JournalReader *r, const char **bytes, size_t *len)
+{
+  unsigned long val;
+  if(!journal_get_varint(r, &val) || val > r->len - r->pos)
+    return false;
+
+  *bytes = r->bytes + r->pos;
+  *len   = val;
+  r->pos += val;
+  return true;
+}
+
+static bool journal_get_frag(JournalReader *r, VTermStringFragment *frag)
+{
+  unsigned long flags;
+  const char *str;
+  size_t len;
+  if(!journal_get_varint(r, &flags) || !journal_get_bytes(r, &str, &len))
+    return false;
+
+  frag->str     = str;
+  frag->len     = len;
+  frag->initial = flags & 1;
+  frag->final   = (flags >> 1) & 1;
+  return true;
+}
+
+/* Copies a length-counted string from the journal into a NUL-terminated one,
+ * as the parser would have given it */
+static bool journal_get_string(JournalReader *r, char *buf, size_t size)
+{
+  const char *bytes;
+  size_t len;
+  if(!journal_get_bytes(r, &bytes, &len) || len >= size)
+    return false;
+
+  memcpy(buf, bytes, len);
+  buf[len] = 0;
+  return true;
+}
+
+static bool replay_record(VTerm *vt, JournalReader *r)
+{
+  const VTermParserCallbacks *cbs = vt->parser.callbacks;
+  void *cbdata = vt->parser.cbdata;
+
+  if(r->pos == r->len)
+    return false;
+
+  switch(r->bytes[r->pos++]) {
+    case 'V':
+      if(r->len - r->pos < 3)
+        return false;
+      if(r->bytes[r->pos] != 'T' || r->bytes[r->pos+1] != 'J' || r->bytes[r->pos+2] != VTERM_JOURNAL_VERSION) {
+        DEBUG_LOG("libvterm: Unrecognised journal header\n");
+        return false;
+      }
+      r->pos += 3;
+      return true;
+
+    case 'T':
+      {
+        const char *bytes;
+        size_t len;
+        if(!journal_get_bytes(r, &bytes, &len))
+          return false;
+
+        while(len) {
+          size_t eaten = 0;
+          if(cbs && cbs->text)
+            eaten = (*cbs->text)(bytes, len, cbdata);
+          if(!eaten || eaten > len)
+            eaten = len;
+          bytes += eaten;
+          len   -= eaten;
+        }
+      }
+      return true;
+
+    case 'C':
+      if(r->pos == r->len)
+        return false;
+      {
+        unsigned char control = r->bytes[r->pos++];
+        if(cbs && cbs->control)
+          (*cbs->control)(control, cbdata);
+      }
+      return true;
+
+    case 'E':
+      {
+        char seq[INTERMED_MAX+1];
+        if(!journal_get_string(r, seq, sizeof(seq)))
+          return false;
+        if(cbs && cbs->escape)
+          (*cbs->escape)(seq, strlen(seq), cbdata);
+      }
+      return true;
+
+    case 'S':
+      {
+        char command, n;
+        char leader[CSI_LEADER_MAX] = "";
+        char intermed[INTERMED_MAX] = "";
+        long args[CSI_ARGS_MAX];
+        int argcount;
+
+        if(r->len - r->pos < 2)
+          return false;
+        command = r->bytes[r->pos++];
+        n       = r->bytes[r->pos++];
+
+        /* The parser always gives at least one argument */
+        argcount = n & JOURNAL_CSI_ARGCOUNT;
+        if(argcount < 1 || argcount > CSI_ARGS_MAX)
+          return false;
+        if((n & JOURNAL_CSI_LEADER) && !journal_get_string(r, leader, sizeof(leader)))
+          return false;
+        if((n & JOURNAL_CSI_INTERMED) && !journal_get_string(r, intermed, sizeof(intermed)))
+          return false;
+
+        for(int i = 0; i < argcount; i++) {
+          unsigned long val;
+          if(!journal_get_varint(r, &val))
+            return false;
+          args[i] = (val >> 1) ? (long)(val >> 1) - 1 : CSI_ARG_MISSING;
+          if(val & JOURNAL_ARG_MORE)
+            args[i] |= CSI_ARG_FLAG_MORE;
+        }
+
+        /* ... and never ends them on a subargument */
+        if(CSI_ARG_HAS_MORE(args[argcount-1]))
+          return false;
+
+        if(cbs && cbs->csi)
+          (*cbs->csi)(leader[0] ? leader : NULL, args, argcount, intermed[0] ? intermed : NULL, command, cbdata);
+      }
+      return true;
+
+    case 'O':
+      {
+        unsigned long command;
+        VTermStringFragment frag;
+        if(!journal_get_varint(r, &command) || !journal_get_frag(r, &frag))
+          return false;
+
+        if(cbs && cbs->osc)
+          (*cbs->osc)((int)command - 1, frag, cbdata);
+      }
+      return true;
+
+    case 'D':
+      {
+        const char *command;
+        size_t commandlen;
+        VTermStringFragment frag;
+        if(!journal_get_bytes(r, &command, &commandlen) || !journal_get_frag(r, &frag))
+          return false;
+
+        if(cbs && cbs->dcs)
+          (*cbs->dcs)(command, commandlen, frag, cbdata);
+      }
+      return true;
+
+    case 'A':
+    case 'P':
+    case 'X':
+      {
+        char type = r->bytes[r->pos - 1];
+        VTermStringFragment frag;
+        if(!journal_get_frag(r, &frag))
+          return false;
+
+        int (*cb)(VTermStringFragment frag, void *user) = NULL;
+        if(cbs)
+          cb = type == 'A' ? cbs->apc :
+               type == 'P' ? cbs->pm :
+                             cbs->sos;
+        if(cb)
+          (*cb)(frag, cbdata);
+      }
+      return true;
+
+    case 'Z':
+      {
+        unsigned long rows, cols;
+        if(!journal_get_varint(r, &rows) || !journal_get_varint(r, &cols))
+          return false;
+        vterm_set_size(vt, rows, cols);
+      }
+      return true;
+
+    default:
+      DEBUG_LOG("libvterm: Unrecognised journal record 0x%02x\n", (unsigned char)r->bytes[r->pos - 1]);
+      return false;
+  }
+}
+
+size_t vterm_journal_replay(VTerm *vt, const char *bytes, size_t len)
+{
+  JournalReader r = {
+    .bytes = bytes,
+    .len   = len,
+  };
+  size_t done = 0;
+
+  while(replay_record(vt, &r))
+    done = r.pos;
+
+  return done;
+}
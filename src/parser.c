@@ -3,365 +3,747 @@
 #include <stdio.h>
 #include <string.h>
 
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
+
 #undef DEBUG_PARSER
 
-static bool is_intermed(unsigned char c)
+#define IS_STRING_STATE(st)      ((st) >= OSC_COMMAND)
+#define IS_STRING_ESC_STATE(st)  ((st) >= OSC_COMMAND_ESC)
+
+/* Returns the length of the run of bytes at the start of the buffer that
+ * carry on the body of a string; that is, everything except C0 controls, DEL,
+ * and the 8-bit ST if C1 controls are recognised. Large payloads such as
+ * OSC 52 clipboard data or DCS images are mostly made of these.
+ */
+static size_t string_body_run(const char bytes[], size_t len, bool c1)
+{
+  size_t i = 0;
+  /* With C1s off, look for DEL twice rather than test c1 on every block */
+  unsigned char st = c1 ? 0x9c : 0x7f;
+
+#ifdef __SSE2__
+  const __m128i c0max = _mm_set1_epi8(0x1f);
+  const __m128i del   = _mm_set1_epi8(0x7f);
+  const __m128i st8   = _mm_set1_epi8((char)st);
+
+#define STOPS(v) \
+  _mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(v, c0max), v), \
+               _mm_or_si128(_mm_cmpeq_epi8(v, del), _mm_cmpeq_epi8(v, st8)))
+
+  for(; i + 32 <= len; i += 32) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(bytes + i));
+    __m128i b = _mm_loadu_si128((const __m128i *)(bytes + i + 16));
+    if(_mm_movemask_epi8(_mm_or_si128(STOPS(a), STOPS(b))))
+      break;
+  }
+#undef STOPS
+#endif
+
+#define BYTEWISE(b)  ((uint64_t)0x0101010101010101 * (b))
+#define HASZERO(x)   (((x) - BYTEWISE(0x01)) & ~(x) & BYTEWISE(0x80))
+  for(; i + 8 <= len; i += 8) {
+    uint64_t x;
+    memcpy(&x, bytes + i, 8);
+
+    if(((x - BYTEWISE(0x20)) & ~x & BYTEWISE(0x80)) || // any byte < 0x20
+       HASZERO(x ^ BYTEWISE(0x7f)) ||
+       HASZERO(x ^ BYTEWISE(st)))
+      break;
+  }
+#undef HASZERO
+#undef BYTEWISE
+
+  for(; i < len; i++) {
+    unsigned char c = bytes[i];
+    if(c < 0x20 || c == 0x7f || c == st)
+      break;
+  }
+
+  return i;
+}
+
+/* A small direct-mapped cache of recently dispatched CSI sequences, keyed on
+ * their bytes after the introducer up to and including the final byte. Only
+ * sequences that arrive whole within one write are looked up or stored */
+#define CSI_CACHE_BITS    6
+#define CSI_CACHE_SIZE    (1 << CSI_CACHE_BITS)
+#define CSI_CACHE_KEY_MAX 16
+
+typedef struct {
+  unsigned char keylen; /* 0 if unused */
+  char key[CSI_CACHE_KEY_MAX];
+
+  unsigned char leaderlen, intermedlen, argi;
+  char leader[CSI_LEADER_MAX];
+  char intermed[INTERMED_MAX];
+  long args[CSI_ARGS_MAX];
+} CSICacheEntry;
+
+struct VTermCSICache {
+  unsigned long hits, misses;
+  CSICacheEntry entries[CSI_CACHE_SIZE];
+};
+
+/* Finds the end of a CSI sequence starting at the given bytes, returning the
+ * length up to and including its final byte, or 0 if it isn't all here or is
+ * too long to cache. Also hashes those bytes */
+static size_t csi_cache_key(const char bytes[], size_t len, unsigned int *hash)
+{
+  unsigned int h = 0;
+
+  for(size_t i = 0; i < len && i < CSI_CACHE_KEY_MAX; i++) {
+    unsigned char c = bytes[i];
+    h = (h << 5) + h + c;
+
+    if(c >= 0x40 && c <= 0x7e) {
+      /* Take the top bits of a multiplicative hash, as the low bits of the
+       * sum above barely differ between sequences that vary in a digit */
+      *hash = (h * 2654435761u) >> (32 - CSI_CACHE_BITS);
+      return i + 1;
+    }
+    if(c < 0x20 || c > 0x3f)
+      return 0;
+  }
+
+  return 0;
+}
+
+static void *parser_malloc(VTermParser *parser, size_t size)
+{
+  void *ptr = (*parser->allocator->malloc)(size, parser->allocdata);
+  if(ptr)
+    memset(ptr, 0, size);
+  return ptr;
+}
+
+static void parser_free(VTermParser *parser, void *ptr)
 {
-  return c >= 0x20 && c <= 0x2f;
+  (*parser->allocator->free)(ptr, parser->allocdata);
 }
 
-static void do_control(VTerm *vt, unsigned char control)
+static VTermParserEvent *push_event(VTermParser *parser, VTermParserEventType type)
 {
-  if(vt->parser.callbacks && vt->parser.callbacks->control)
-    if((*vt->parser.callbacks->control)(control, vt->parser.cbdata))
+  VTermParserEvent *ev = &parser->pull->events[parser->pull->nevents++];
+  ev->type = type;
+  if(parser->pull->nevents > PULL_EVENTS_MAX - 4)
+    parser->pull->full = true;
+  return ev;
+}
+
+static void do_control(VTermParser *parser, unsigned char control)
+{
+  if(parser->pulling) {
+    push_event(parser, VTERM_PARSER_EVENT_CONTROL)->v.control = control;
+    return;
+  }
+
+  if(parser->callbacks && parser->callbacks->control)
+    if((*parser->callbacks->control)(control, parser->cbdata))
       return;
 
   DEBUG_LOG("libvterm: Unhandled control 0x%02x\n", control);
 }
 
-static void do_csi(VTerm *vt, char command)
+static void do_csi(VTermParser *parser, char command)
 {
 #ifdef DEBUG_PARSER
   printf("Parsed CSI args as:\n", arglen, args);
-  printf(" leader: %s\n", vt->parser.v.csi.leader);
-  for(int argi = 0; argi < vt->parser.v.csi.argi; argi++) {
-    printf(" %lu", CSI_ARG(vt->parser.v.csi.args[argi]));
-    if(!CSI_ARG_HAS_MORE(vt->parser.v.csi.args[argi]))
+  printf(" leader: %s\n", parser->v.csi.leader);
+  for(int argi = 0; argi < parser->v.csi.argi; argi++) {
+    printf(" %lu", CSI_ARG(parser->v.csi.args[argi]));
+    if(!CSI_ARG_HAS_MORE(parser->v.csi.args[argi]))
       printf("\n");
-  printf(" intermed: %s\n", vt->parser.intermed);
+  printf(" intermed: %s\n", parser->intermed);
   }
 #endif
 
-  if(vt->parser.callbacks && vt->parser.callbacks->csi)
-    if((*vt->parser.callbacks->csi)(
-          vt->parser.v.csi.leaderlen ? vt->parser.v.csi.leader : NULL, 
-          vt->parser.v.csi.args,
-          vt->parser.v.csi.argi,
-          vt->parser.intermedlen ? vt->parser.intermed : NULL,
+  if(parser->pulling) {
+    VTermParserEvent *ev = push_event(parser, VTERM_PARSER_EVENT_CSI);
+    ev->v.csi.leader   = parser->v.csi.leaderlen ? parser->v.csi.leader : NULL;
+    ev->v.csi.args     = parser->v.csi.args;
+    ev->v.csi.argcount = parser->v.csi.argi;
+    ev->v.csi.intermed = parser->intermedlen ? parser->intermed : NULL;
+    ev->v.csi.command  = command;
+    parser->pull->full = true;
+    return;
+  }
+
+  if(parser->callbacks && parser->callbacks->csi)
+    if((*parser->callbacks->csi)(
+          parser->v.csi.leaderlen ? parser->v.csi.leader : NULL, 
+          parser->v.csi.args,
+          parser->v.csi.argi,
+          parser->intermedlen ? parser->intermed : NULL,
           command,
-          vt->parser.cbdata))
+          parser->cbdata))
       return;
 
   DEBUG_LOG("libvterm: Unhandled CSI %c\n", command);
 }
 
-static void do_escape(VTerm *vt, char command)
+static void do_escape(VTermParser *parser, char command)
 {
-  char seq[INTERMED_MAX+1];
+  char seq_local[INTERMED_MAX+1];
+  /* A pulled event has to point at something that outlives this call */
+  char *seq = parser->pulling ? parser->pull->escape : seq_local;
 
-  size_t len = vt->parser.intermedlen;
-  strncpy(seq, vt->parser.intermed, len);
+  size_t len = parser->intermedlen;
+  strncpy(seq, parser->intermed, len);
   seq[len++] = command;
   seq[len]   = 0;
 
-  if(vt->parser.callbacks && vt->parser.callbacks->escape)
-    if((*vt->parser.callbacks->escape)(seq, len, vt->parser.cbdata))
+  if(parser->pulling) {
+    VTermParserEvent *ev = push_event(parser, VTERM_PARSER_EVENT_ESCAPE);
+    ev->v.escape.bytes = seq;
+    ev->v.escape.len   = len;
+    parser->pull->full = true;
+    return;
+  }
+
+  if(parser->callbacks && parser->callbacks->escape)
+    if((*parser->callbacks->escape)(seq, len, parser->cbdata))
       return;
 
   DEBUG_LOG("libvterm: Unhandled escape ESC 0x%02x\n", command);
 }
 
-static void string_fragment(VTerm *vt, const char *str, size_t len, bool final)
+static size_t string_limit(VTermParser *parser, enum VTermParserState state)
+{
+  switch(state) {
+    case OSC:
+    case OSC_ESC:
+      return parser->string_limit.osc;
+    case DCS:
+    case DCS_ESC:
+      return parser->string_limit.dcs;
+    case APC:
+    case APC_ESC:
+      return parser->string_limit.apc;
+    case PM:
+    case PM_ESC:
+      return parser->string_limit.pm;
+    case SOS:
+    case SOS_ESC:
+      return parser->string_limit.sos;
+    default:
+      return 0;
+  }
+}
+
+static void deliver_fragment(VTermParser *parser, enum VTermParserState state, VTermStringFragment frag)
 {
-  VTermStringFragment frag = {
-    .str     = str,
-    .len     = len,
-    .initial = vt->parser.string_initial,
-    .final   = final,
-  };
-
-  switch(vt->parser.state) {
+  switch(state) {
     case OSC:
-      if(vt->parser.callbacks && vt->parser.callbacks->osc)
-        (*vt->parser.callbacks->osc)(vt->parser.v.osc.command, frag, vt->parser.cbdata);
+    case OSC_ESC:
+      if(parser->pulling) {
+        VTermParserEvent *ev = push_event(parser, VTERM_PARSER_EVENT_OSC);
+        ev->v.osc.command = parser->v.osc.command;
+        ev->v.osc.frag    = frag;
+      }
+      else if(parser->callbacks && parser->callbacks->osc)
+        (*parser->callbacks->osc)(parser->v.osc.command, frag, parser->cbdata);
       break;
 
     case DCS:
-      if(vt->parser.callbacks && vt->parser.callbacks->dcs)
-        (*vt->parser.callbacks->dcs)(vt->parser.v.dcs.command, vt->parser.v.dcs.commandlen, frag, vt->parser.cbdata);
+    case DCS_ESC:
+      if(parser->pulling) {
+        VTermParserEvent *ev = push_event(parser, VTERM_PARSER_EVENT_DCS);
+        ev->v.dcs.command    = parser->v.dcs.command;
+        ev->v.dcs.commandlen = parser->v.dcs.commandlen;
+        ev->v.dcs.frag       = frag;
+        parser->pull->full = true;
+      }
+      else if(parser->callbacks && parser->callbacks->dcs)
+        (*parser->callbacks->dcs)(parser->v.dcs.command, parser->v.dcs.commandlen, frag, parser->cbdata);
       break;
 
     case APC:
-      if(vt->parser.callbacks && vt->parser.callbacks->apc)
-        (*vt->parser.callbacks->apc)(frag, vt->parser.cbdata);
+    case APC_ESC:
+      if(parser->pulling)
+        push_event(parser, VTERM_PARSER_EVENT_APC)->v.frag = frag;
+      else if(parser->callbacks && parser->callbacks->apc)
+        (*parser->callbacks->apc)(frag, parser->cbdata);
       break;
 
     case PM:
-      if(vt->parser.callbacks && vt->parser.callbacks->pm)
-        (*vt->parser.callbacks->pm)(frag, vt->parser.cbdata);
+    case PM_ESC:
+      if(parser->pulling)
+        push_event(parser, VTERM_PARSER_EVENT_PM)->v.frag = frag;
+      else if(parser->callbacks && parser->callbacks->pm)
+        (*parser->callbacks->pm)(frag, parser->cbdata);
       break;
 
     case SOS:
-      if(vt->parser.callbacks && vt->parser.callbacks->sos)
-        (*vt->parser.callbacks->sos)(frag, vt->parser.cbdata);
+    case SOS_ESC:
+      if(parser->pulling)
+        push_event(parser, VTERM_PARSER_EVENT_SOS)->v.frag = frag;
+      else if(parser->callbacks && parser->callbacks->sos)
+        (*parser->callbacks->sos)(frag, parser->cbdata);
       break;
 
-    case NORMAL:
-    case CSI_LEADER:
-    case CSI_ARGS:
-    case CSI_INTERMED:
-    case OSC_COMMAND:
-    case DCS_COMMAND:
+    default:
       break;
   }
+}
+
+/* Adds a fragment to the string being gathered, unless it would grow past
+ * the limit */
+static bool gather_string(VTermParser *parser, const char *str, size_t len)
+{
+  if(len > parser->whole.limit - parser->whole.len)
+    return false;
+
+  if(!parser->whole.buffer || parser->whole.len + len > parser->whole.size) {
+    size_t size = parser->whole.size ? parser->whole.size : 256;
+    while(size < parser->whole.len + len)
+      size *= 2;
+    if(size > parser->whole.limit)
+      size = parser->whole.limit;
+
+    char *buffer = parser_malloc(parser, size);
+    if(!buffer)
+      return false;
 
-  vt->parser.string_initial = false;
+    if(parser->whole.buffer) {
+      memcpy(buffer, parser->whole.buffer, parser->whole.len);
+      parser_free(parser, parser->whole.buffer);
+    }
+
+    parser->whole.buffer = buffer;
+    parser->whole.size   = size;
+  }
+
+  memcpy(parser->whole.buffer + parser->whole.len, str, len);
+  parser->whole.len += len;
+  return true;
 }
 
-size_t vterm_input_write(VTerm *vt, const char *bytes, size_t len)
+static void deliver_gathered(VTermParser *parser, enum VTermParserState state, bool final)
 {
-  size_t pos = 0;
-  const char *string_start;
-
-  switch(vt->parser.state) {
-  case NORMAL:
-  case CSI_LEADER:
-  case CSI_ARGS:
-  case CSI_INTERMED:
-  case OSC_COMMAND:
-  case DCS_COMMAND:
-    string_start = NULL;
-    break;
-  case OSC:
-  case DCS:
-  case APC:
-  case PM:
-  case SOS:
-    string_start = bytes;
-    break;
+  deliver_fragment(parser, state, (VTermStringFragment){
+      .str     = parser->whole.buffer,
+      .len     = parser->whole.len,
+      .initial = true,
+      .final   = final,
+    });
+
+  /* A pulled event points into the buffer, which the next string reuses */
+  if(parser->pulling)
+    parser->pull->full = true;
+}
+
+static void string_fragment(VTermParser *parser, enum VTermParserState state, const char *str, size_t len, bool final)
+{
+  bool initial = parser->string_initial;
+  parser->string_initial = false;
+
+  if(initial) {
+    parser->string_len = 0;
+    parser->string_skip = false;
+    parser->whole.len = 0;
+    parser->whole.limit = parser->whole.max;
   }
 
-#define ENTER_STATE(st)        do { vt->parser.state = st; string_start = NULL; } while(0)
-#define ENTER_NORMAL_STATE()   ENTER_STATE(NORMAL)
+  if(parser->string_skip) {
+    parser->string_discarded += len;
+    return;
+  }
 
-#define IS_STRING_STATE()      (vt->parser.state >= OSC_COMMAND)
+  /* Pass on what fits within the limit, then skip the rest of the string
+   * without a final fragment, as if it had been cancelled */
+  size_t limit = string_limit(parser, state);
+  if(limit && len > limit - parser->string_len) {
+    size_t keep = limit - parser->string_len;
 
-  for( ; pos < len; pos++) {
-    unsigned char c = bytes[pos];
-    bool c1_allowed = !vt->mode.utf8;
+    parser->string_discarded += len - keep;
+    parser->string_skip = true;
 
-    if(c == 0x00 || c == 0x7f) { // NUL, DEL
-      if(IS_STRING_STATE()) {
-        string_fragment(vt, string_start, bytes + pos - string_start, false);
-        string_start = bytes + pos + 1;
-      }
-      if(vt->parser.emit_nul)
-        do_control(vt, c);
-      continue;
-    }
-    if(c == 0x18 || c == 0x1a) { // CAN, SUB
-      vt->parser.in_esc = false;
-      ENTER_NORMAL_STATE();
-      if(vt->parser.emit_nul)
-        do_control(vt, c);
-      continue;
-    }
-    else if(c == 0x1b) { // ESC
-      vt->parser.intermedlen = 0;
-      if(!IS_STRING_STATE())
-        vt->parser.state = NORMAL;
-      vt->parser.in_esc = true;
-      continue;
-    }
-    else if(c == 0x07 &&  // BEL, can stand for ST in OSC or DCS state
-            IS_STRING_STATE()) {
-      // fallthrough
-    }
-    else if(c < 0x20) { // other C0
-      if(vt->parser.state == SOS)
-        continue; // All other C0s permitted in SOS
-
-      if(IS_STRING_STATE())
-        string_fragment(vt, string_start, bytes + pos - string_start, false);
-      do_control(vt, c);
-      if(IS_STRING_STATE())
-        string_start = bytes + pos + 1;
-      continue;
-    }
-    // else fallthrough
+    len = keep;
+    final = false;
+  }
+  parser->string_len += len;
 
-    size_t string_len = bytes + pos - string_start;
+  if(parser->whole.limit) {
+    /* A string that arrives in one piece needs no copying */
+    if(initial && final) {
+      parser->whole.limit = 0;
+      deliver_fragment(parser, state, (VTermStringFragment){
+          .str = str, .len = len, .initial = true, .final = true,
+        });
+      return;
+    }
 
-    if(vt->parser.in_esc) {
-      // Hoist an ESC letter into a C1 if we're not in a string mode
-      // Always accept ESC \ == ST even in string mode
-      if(!vt->parser.intermedlen &&
-          c >= 0x40 && c < 0x60 &&
-          ((!IS_STRING_STATE() || c == 0x5c))) {
-        c += 0x40;
-        c1_allowed = true;
-        if(string_len)
-          string_len -= 1;
-        vt->parser.in_esc = false;
-      }
-      else {
-        string_start = NULL;
-        vt->parser.state = NORMAL;
+    if(!parser->string_skip && gather_string(parser, str, len)) {
+      if(final) {
+        parser->whole.limit = 0;
+        deliver_gathered(parser, state, true);
       }
+      return;
     }
 
-    switch(vt->parser.state) {
-    case CSI_LEADER:
-      /* Extract leader bytes 0x3c to 0x3f */
-      if(c >= 0x3c && c <= 0x3f) {
-        if(vt->parser.v.csi.leaderlen < CSI_LEADER_MAX-1)
-          vt->parser.v.csi.leader[vt->parser.v.csi.leaderlen++] = c;
-        break;
-      }
+    /* It is too long to gather, or has been cut short by its limit, so pass
+     * on what was gathered, if this is not the start of it, and carry on in
+     * fragments as they arrive */
+    parser->whole.limit = 0;
+    if(!initial)
+      deliver_gathered(parser, state, false);
+  }
 
-      /* else fallthrough */
-      vt->parser.v.csi.leader[vt->parser.v.csi.leaderlen] = 0;
+  if(!len && parser->string_skip)
+    return;
 
-      vt->parser.v.csi.argi = 0;
-      vt->parser.v.csi.args[0] = CSI_ARG_MISSING;
-      vt->parser.state = CSI_ARGS;
+  deliver_fragment(parser, state, (VTermStringFragment){
+      .str     = str,
+      .len     = len,
+      .initial = initial,
+      .final   = final,
+    });
+}
 
-      /* fallthrough */
-    case CSI_ARGS:
-      /* Numerical value of argument */
-      if(c >= '0' && c <= '9') {
-        if(vt->parser.v.csi.args[vt->parser.v.csi.argi] == CSI_ARG_MISSING)
-          vt->parser.v.csi.args[vt->parser.v.csi.argi] = 0;
-        vt->parser.v.csi.args[vt->parser.v.csi.argi] *= 10;
-        vt->parser.v.csi.args[vt->parser.v.csi.argi] += c - '0';
-        break;
-      }
-      if(c == ':') {
-        vt->parser.v.csi.args[vt->parser.v.csi.argi] |= CSI_ARG_FLAG_MORE;
-        c = ';';
-      }
-      if(c == ';') {
-        vt->parser.v.csi.argi++;
-        vt->parser.v.csi.args[vt->parser.v.csi.argi] = CSI_ARG_MISSING;
+/* Input bytes are first sorted into classes, and then each (state, class)
+ * pair picks an action to perform and the state to move to, in the manner of
+ * the well-known VT500 parser state diagram */
+enum {
+  BC_NUL,    /* NUL, DEL */
+  BC_CANSUB, /* CAN, SUB */
+  BC_ESC,
+  BC_BEL,
+  BC_C0,     /* any other C0 */
+  BC_INTER,  /* 0x20 to 0x2F */
+  BC_DIGIT,
+  BC_COLON,
+  BC_SEMI,
+  BC_LEADER, /* 0x3C to 0x3F */
+  BC_UPPER,  /* 0x40 to 0x5F except backslash; ESC + these form a C1 */
+  BC_BSLASH,
+  BC_LOWER,  /* 0x60 to 0x7E */
+  BC_HIGH,   /* 0xA0 to 0xFF, and 0x80 to 0x9F in UTF-8 mode */
+  BC_C1,     /* any other C1 */
+  BC_DCS,
+  BC_SOS,
+  BC_CSI,
+  BC_ST,
+  BC_OSC,
+  BC_PM,
+  BC_APC,
+
+  N_BYTE_CLASSES
+};
+
+static const unsigned char byte_class[256] = {
+  BC_NUL,    BC_C0,     BC_C0,     BC_C0,     BC_C0,     BC_C0,     BC_C0,     BC_BEL,    /* 00 */
+  BC_C0,     BC_C0,     BC_C0,     BC_C0,     BC_C0,     BC_C0,     BC_C0,     BC_C0,     /* 08 */
+  BC_C0,     BC_C0,     BC_C0,     BC_C0,     BC_C0,     BC_C0,     BC_C0,     BC_C0,     /* 10 */
+  BC_CANSUB, BC_C0,     BC_CANSUB, BC_ESC,    BC_C0,     BC_C0,     BC_C0,     BC_C0,     /* 18 */
+  BC_INTER,  BC_INTER,  BC_INTER,  BC_INTER,  BC_INTER,  BC_INTER,  BC_INTER,  BC_INTER,  /* 20 */
+  BC_INTER,  BC_INTER,  BC_INTER,  BC_INTER,  BC_INTER,  BC_INTER,  BC_INTER,  BC_INTER,  /* 28 */
+  BC_DIGIT,  BC_DIGIT,  BC_DIGIT,  BC_DIGIT,  BC_DIGIT,  BC_DIGIT,  BC_DIGIT,  BC_DIGIT,  /* 30 */
+  BC_DIGIT,  BC_DIGIT,  BC_COLON,  BC_SEMI,   BC_LEADER, BC_LEADER, BC_LEADER, BC_LEADER, /* 38 */
+  BC_UPPER,  BC_UPPER,  BC_UPPER,  BC_UPPER,  BC_UPPER,  BC_UPPER,  BC_UPPER,  BC_UPPER,  /* 40 */
+  BC_UPPER,  BC_UPPER,  BC_UPPER,  BC_UPPER,  BC_UPPER,  BC_UPPER,  BC_UPPER,  BC_UPPER,  /* 48 */
+  BC_UPPER,  BC_UPPER,  BC_UPPER,  BC_UPPER,  BC_UPPER,  BC_UPPER,  BC_UPPER,  BC_UPPER,  /* 50 */
+  BC_UPPER,  BC_UPPER,  BC_UPPER,  BC_UPPER,  BC_BSLASH, BC_UPPER,  BC_UPPER,  BC_UPPER,  /* 58 */
+  BC_LOWER,  BC_LOWER,  BC_LOWER,  BC_LOWER,  BC_LOWER,  BC_LOWER,  BC_LOWER,  BC_LOWER,  /* 60 */
+  BC_LOWER,  BC_LOWER,  BC_LOWER,  BC_LOWER,  BC_LOWER,  BC_LOWER,  BC_LOWER,  BC_LOWER,  /* 68 */
+  BC_LOWER,  BC_LOWER,  BC_LOWER,  BC_LOWER,  BC_LOWER,  BC_LOWER,  BC_LOWER,  BC_LOWER,  /* 70 */
+  BC_LOWER,  BC_LOWER,  BC_LOWER,  BC_LOWER,  BC_LOWER,  BC_LOWER,  BC_LOWER,  BC_NUL,    /* 78 */
+  BC_C1,     BC_C1,     BC_C1,     BC_C1,     BC_C1,     BC_C1,     BC_C1,     BC_C1,     /* 80 */
+  BC_C1,     BC_C1,     BC_C1,     BC_C1,     BC_C1,     BC_C1,     BC_C1,     BC_C1,     /* 88 */
+  BC_DCS,    BC_C1,     BC_C1,     BC_C1,     BC_C1,     BC_C1,     BC_C1,     BC_C1,     /* 90 */
+  BC_SOS,    BC_C1,     BC_C1,     BC_CSI,    BC_ST,     BC_OSC,    BC_PM,     BC_APC,    /* 98 */
+  BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   /* A0 */
+  BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   /* A8 */
+  BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   /* B0 */
+  BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   /* B8 */
+  BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   /* C0 */
+  BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   /* C8 */
+  BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   /* D0 */
+  BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   /* D8 */
+  BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   /* E0 */
+  BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   /* E8 */
+  BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   /* F0 */
+  BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   /* F8 */
+};
+
+static const unsigned char byte_class_utf8[256] = {
+  BC_NUL,    BC_C0,     BC_C0,     BC_C0,     BC_C0,     BC_C0,     BC_C0,     BC_BEL,    /* 00 */
+  BC_C0,     BC_C0,     BC_C0,     BC_C0,     BC_C0,     BC_C0,     BC_C0,     BC_C0,     /* 08 */
+  BC_C0,     BC_C0,     BC_C0,     BC_C0,     BC_C0,     BC_C0,     BC_C0,     BC_C0,     /* 10 */
+  BC_CANSUB, BC_C0,     BC_CANSUB, BC_ESC,    BC_C0,     BC_C0,     BC_C0,     BC_C0,     /* 18 */
+  BC_INTER,  BC_INTER,  BC_INTER,  BC_INTER,  BC_INTER,  BC_INTER,  BC_INTER,  BC_INTER,  /* 20 */
+  BC_INTER,  BC_INTER,  BC_INTER,  BC_INTER,  BC_INTER,  BC_INTER,  BC_INTER,  BC_INTER,  /* 28 */
+  BC_DIGIT,  BC_DIGIT,  BC_DIGIT,  BC_DIGIT,  BC_DIGIT,  BC_DIGIT,  BC_DIGIT,  BC_DIGIT,  /* 30 */
+  BC_DIGIT,  BC_DIGIT,  BC_COLON,  BC_SEMI,   BC_LEADER, BC_LEADER, BC_LEADER, BC_LEADER, /* 38 */
+  BC_UPPER,  BC_UPPER,  BC_UPPER,  BC_UPPER,  BC_UPPER,  BC_UPPER,  BC_UPPER,  BC_UPPER,  /* 40 */
+  BC_UPPER,  BC_UPPER,  BC_UPPER,  BC_UPPER,  BC_UPPER,  BC_UPPER,  BC_UPPER,  BC_UPPER,  /* 48 */
+  BC_UPPER,  BC_UPPER,  BC_UPPER,  BC_UPPER,  BC_UPPER,  BC_UPPER,  BC_UPPER,  BC_UPPER,  /* 50 */
+  BC_UPPER,  BC_UPPER,  BC_UPPER,  BC_UPPER,  BC_BSLASH, BC_UPPER,  BC_UPPER,  BC_UPPER,  /* 58 */
+  BC_LOWER,  BC_LOWER,  BC_LOWER,  BC_LOWER,  BC_LOWER,  BC_LOWER,  BC_LOWER,  BC_LOWER,  /* 60 */
+  BC_LOWER,  BC_LOWER,  BC_LOWER,  BC_LOWER,  BC_LOWER,  BC_LOWER,  BC_LOWER,  BC_LOWER,  /* 68 */
+  BC_LOWER,  BC_LOWER,  BC_LOWER,  BC_LOWER,  BC_LOWER,  BC_LOWER,  BC_LOWER,  BC_LOWER,  /* 70 */
+  BC_LOWER,  BC_LOWER,  BC_LOWER,  BC_LOWER,  BC_LOWER,  BC_LOWER,  BC_LOWER,  BC_NUL,    /* 78 */
+  BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   /* 80 */
+  BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   /* 88 */
+  BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   /* 90 */
+  BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   /* 98 */
+  BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   /* A0 */
+  BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   /* A8 */
+  BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   /* B0 */
+  BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   /* B8 */
+  BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   /* C0 */
+  BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   /* C8 */
+  BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   /* D0 */
+  BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   /* D8 */
+  BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   /* E0 */
+  BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   /* E8 */
+  BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   /* F0 */
+  BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   BC_HIGH,   /* F8 */
+};
+
+enum {
+  ACT_IGNORE,
+  ACT_NUL,
+  ACT_CANCEL,
+  ACT_ESC,
+  ACT_CONTROL,
+  ACT_STRING_CONTROL,
+  ACT_TEXT,
+  ACT_C1_ESCAPE,      /* ESC + 0x40 to 0x5F stands for a C1 */
+  ACT_ESC_INTER,
+  ACT_ESC_DISPATCH,
+  ACT_STRING_ABORT,
+  ACT_CSI_START,
+  ACT_CSI_LEADER,
+  ACT_CSI_DIGIT,
+  ACT_CSI_COLON,
+  ACT_CSI_SEMI,
+  ACT_CSI_ARGS_INTER, /* first intermediate, ending the arguments */
+  ACT_CSI_INTER,
+  ACT_CSI_ARGS_FINAL, /* final byte straight after the arguments */
+  ACT_CSI_DISPATCH,
+  ACT_DCS_START,
+  ACT_DCS_COMMAND,
+  ACT_DCS_COMMAND_END,
+  ACT_OSC_START,
+  ACT_OSC_DIGIT,
+  ACT_OSC_SEMI,
+  ACT_OSC_STRING,
+  ACT_OSC_EMPTY,
+  ACT_STRING_START,
+  ACT_STRING_END,
+  ACT_STRING_ESC_END,
+};
+
+typedef struct {
+  unsigned char action;
+  unsigned char next;
+} ParserTransition;
+
+#define T(act, st)  { ACT_##act, st }
+
+/* Handling of controls common to all the non-string states */
+#define CONTROLS(st) \
+  [BC_NUL] = T(NUL, st), [BC_CANSUB] = T(CANCEL, NORMAL), [BC_ESC] = T(ESC, ESCAPE), \
+  [BC_BEL] = T(CONTROL, st), [BC_C0] = T(CONTROL, st)
+
+/* ... and to the string states, where BEL is left to each one */
+#define STRING_CONTROLS(st, c0act) \
+  [BC_NUL] = T(NUL, st), [BC_CANSUB] = T(CANCEL, NORMAL), [BC_ESC] = T(ESC, st##_ESC), \
+  [BC_C0] = T(c0act, st)
+
+#define PARAMS(act, st) \
+  [BC_DIGIT] = T(act, st), [BC_COLON] = T(act, st), [BC_SEMI] = T(act, st), [BC_LEADER] = T(act, st)
+#define FINALS(act, st) \
+  [BC_UPPER] = T(act, st), [BC_BSLASH] = T(act, st), [BC_LOWER] = T(act, st)
+#define C1S(act, st) \
+  [BC_C1] = T(act, st), [BC_DCS] = T(act, st), [BC_SOS] = T(act, st), [BC_CSI] = T(act, st), \
+  [BC_OSC] = T(act, st), [BC_PM] = T(act, st), [BC_APC] = T(act, st)
+
+/* After an ESC inside a string, ESC \ is ST and anything else abandons the
+ * string and is taken as the rest of an escape sequence */
+#define STRING_ESC_ROW(st, c0act, stact) \
+  [st##_ESC] = { \
+    [BC_NUL] = T(NUL, st##_ESC), [BC_CANSUB] = T(CANCEL, NORMAL), [BC_ESC] = T(ESC, st##_ESC), \
+    [BC_BEL] = T(STRING_ABORT, ESCAPE), [BC_C0] = T(c0act, st##_ESC), \
+    [BC_INTER] = T(ESC_INTER, ESCAPE_INTERMED), PARAMS(ESC_DISPATCH, NORMAL), \
+    [BC_UPPER] = T(ESC_DISPATCH, NORMAL), [BC_BSLASH] = T(stact, NORMAL), [BC_LOWER] = T(ESC_DISPATCH, NORMAL), \
+    [BC_HIGH] = T(STRING_ABORT, ESCAPE), [BC_ST] = T(STRING_ABORT, ESCAPE), C1S(STRING_ABORT, ESCAPE), \
+  }
+
+/* Unlisted entries are zero; that is, ignore the byte and return to NORMAL */
+static const ParserTransition transitions[N_PARSER_STATES][N_BYTE_CLASSES] = {
+  [NORMAL] = {
+    CONTROLS(NORMAL),
+    [BC_INTER] = T(TEXT, NORMAL), PARAMS(TEXT, NORMAL), FINALS(TEXT, NORMAL), [BC_HIGH] = T(TEXT, NORMAL),
+    [BC_C1]  = T(CONTROL, NORMAL),      [BC_ST]  = T(CONTROL, NORMAL),
+    [BC_DCS] = T(DCS_START, DCS_COMMAND), [BC_CSI] = T(CSI_START, CSI_LEADER), [BC_OSC] = T(OSC_START, OSC_COMMAND),
+    [BC_SOS] = T(STRING_START, SOS),    [BC_PM]  = T(STRING_START, PM),      [BC_APC] = T(STRING_START, APC),
+  },
+  [ESCAPE] = {
+    CONTROLS(ESCAPE),
+    [BC_INTER] = T(ESC_INTER, ESCAPE_INTERMED), PARAMS(ESC_DISPATCH, NORMAL),
+    [BC_UPPER] = T(C1_ESCAPE, NORMAL), [BC_BSLASH] = T(C1_ESCAPE, NORMAL), [BC_LOWER] = T(ESC_DISPATCH, NORMAL),
+    [BC_HIGH] = T(IGNORE, ESCAPE), [BC_ST] = T(IGNORE, ESCAPE), C1S(IGNORE, ESCAPE),
+  },
+  [ESCAPE_INTERMED] = {
+    CONTROLS(ESCAPE_INTERMED),
+    [BC_INTER] = T(ESC_INTER, ESCAPE_INTERMED), PARAMS(ESC_DISPATCH, NORMAL), FINALS(ESC_DISPATCH, NORMAL),
+    [BC_HIGH] = T(IGNORE, ESCAPE_INTERMED), [BC_ST] = T(IGNORE, ESCAPE_INTERMED), C1S(IGNORE, ESCAPE_INTERMED),
+  },
+  [CSI_LEADER] = {
+    CONTROLS(CSI_LEADER),
+    [BC_INTER] = T(CSI_ARGS_INTER, CSI_INTERMED),
+    [BC_DIGIT] = T(CSI_DIGIT, CSI_ARGS), [BC_COLON] = T(CSI_COLON, CSI_ARGS),
+    [BC_SEMI] = T(CSI_SEMI, CSI_ARGS), [BC_LEADER] = T(CSI_LEADER, CSI_LEADER),
+    FINALS(CSI_ARGS_FINAL, NORMAL),
+  },
+  [CSI_ARGS] = {
+    CONTROLS(CSI_ARGS),
+    [BC_INTER] = T(CSI_ARGS_INTER, CSI_INTERMED),
+    [BC_DIGIT] = T(CSI_DIGIT, CSI_ARGS), [BC_COLON] = T(CSI_COLON, CSI_ARGS),
+    [BC_SEMI] = T(CSI_SEMI, CSI_ARGS),
+    FINALS(CSI_ARGS_FINAL, NORMAL),
+  },
+  [CSI_INTERMED] = {
+    CONTROLS(CSI_INTERMED),
+    [BC_INTER] = T(CSI_INTER, CSI_INTERMED), FINALS(CSI_DISPATCH, NORMAL),
+  },
+  [DCS_COMMAND] = {
+    CONTROLS(DCS_COMMAND),
+    [BC_INTER] = T(DCS_COMMAND, DCS_COMMAND), PARAMS(DCS_COMMAND, DCS_COMMAND), FINALS(DCS_COMMAND_END, DCS),
+    [BC_HIGH] = T(DCS_COMMAND, DCS_COMMAND), [BC_ST] = T(DCS_COMMAND, DCS_COMMAND), C1S(DCS_COMMAND, DCS_COMMAND),
+  },
+  [OSC_COMMAND] = {
+    STRING_CONTROLS(OSC_COMMAND, STRING_CONTROL), [BC_BEL] = T(OSC_EMPTY, NORMAL),
+    [BC_INTER] = T(OSC_STRING, OSC),
+    [BC_DIGIT] = T(OSC_DIGIT, OSC_COMMAND), [BC_COLON] = T(OSC_STRING, OSC),
+    [BC_SEMI] = T(OSC_SEMI, OSC), [BC_LEADER] = T(OSC_STRING, OSC),
+    FINALS(OSC_STRING, OSC), [BC_HIGH] = T(OSC_STRING, OSC), [BC_ST] = T(OSC_EMPTY, NORMAL), C1S(OSC_STRING, OSC),
+  },
+#define STRING_ROW(st, c0act) \
+  [st] = { \
+    STRING_CONTROLS(st, c0act), [BC_BEL] = T(STRING_END, NORMAL), \
+    [BC_INTER] = T(IGNORE, st), PARAMS(IGNORE, st), FINALS(IGNORE, st), \
+    [BC_HIGH] = T(IGNORE, st), [BC_ST] = T(STRING_END, NORMAL), C1S(IGNORE, st), \
+  }
+  STRING_ROW(OSC, STRING_CONTROL),
+  STRING_ROW(DCS, STRING_CONTROL),
+  STRING_ROW(APC, STRING_CONTROL),
+  STRING_ROW(PM,  STRING_CONTROL),
+  /* All other C0s are permitted in SOS */
+  STRING_ROW(SOS, IGNORE),
+
+  STRING_ESC_ROW(OSC_COMMAND, STRING_CONTROL, OSC_EMPTY),
+  STRING_ESC_ROW(OSC, STRING_CONTROL, STRING_ESC_END),
+  STRING_ESC_ROW(DCS, STRING_CONTROL, STRING_ESC_END),
+  STRING_ESC_ROW(APC, STRING_CONTROL, STRING_ESC_END),
+  STRING_ESC_ROW(PM,  STRING_CONTROL, STRING_ESC_END),
+  STRING_ESC_ROW(SOS, IGNORE, STRING_ESC_END),
+};
+
+#undef T
+
+/* Runs the parser over the buffer, returning how much of it was consumed.
+ * That is all of it, unless pulling events, when it stops once the batch of
+ * them is full */
+static size_t parse(VTermParser *parser, const char *bytes, size_t len)
+{
+  size_t pos = 0;
+  bool pulling = parser->pulling;
+  /* A CSI missed in the cache, to store once it has been parsed */
+  const char *csi_key = NULL;
+  size_t csi_keylen = 0;
+  CSICacheEntry *csi_slot = NULL;
+  enum VTermParserState state = parser->state;
+  const char *string_start = NULL;
+  const unsigned char *classes = parser->utf8 ? byte_class_utf8 : byte_class;
+
+  /* A string carries on from the previous write, unless its OSC command
+   * number is still being read */
+  if(IS_STRING_STATE(state) && state != OSC_COMMAND && state != OSC_COMMAND_ESC)
+    string_start = bytes;
+
+  for( ; pos < len; pos++) {
+    unsigned char c = bytes[pos];
+    int class = classes[c];
+    const ParserTransition *trans;
+
+dispatch:
+    trans = &transitions[state][class];
+
+    switch(trans->action) {
+    case ACT_IGNORE:
+      if(trans->next != state)
         break;
-      }
 
-      /* else fallthrough */
-      vt->parser.v.csi.argi++;
-      vt->parser.intermedlen = 0;
-      vt->parser.state = CSI_INTERMED;
-    case CSI_INTERMED:
-      if(is_intermed(c)) {
-        if(vt->parser.intermedlen < INTERMED_MAX-1)
-          vt->parser.intermed[vt->parser.intermedlen++] = c;
+      if(state >= OSC && state <= SOS) {
+        pos += string_body_run(bytes + pos + 1, len - pos - 1, !parser->utf8);
         break;
       }
-      else if(c == 0x1b) {
-        /* ESC in CSI cancels */
-      }
-      else if(c >= 0x40 && c <= 0x7e) {
-        vt->parser.intermed[vt->parser.intermedlen] = 0;
-        do_csi(vt, c);
-      }
-      /* else was invalid CSI */
 
-      ENTER_NORMAL_STATE();
+      /* Skip the rest of a run of ignored bytes without going round the
+       * whole loop for each */
+      {
+        const ParserTransition *row = transitions[state];
+        while(pos + 1 < len) {
+          const ParserTransition *t = &row[classes[(unsigned char)bytes[pos + 1]]];
+          if(t->action != ACT_IGNORE || t->next != state)
+            break;
+          pos++;
+        }
+      }
       break;
 
-    case OSC_COMMAND:
-      /* Numerical value of command */
-      if(c >= '0' && c <= '9') {
-        if(vt->parser.v.osc.command == -1)
-          vt->parser.v.osc.command = 0;
-        else
-          vt->parser.v.osc.command *= 10;
-        vt->parser.v.osc.command += c - '0';
-        break;
-      }
-      if(c == ';') {
-        vt->parser.state = OSC;
+    case ACT_NUL:
+      if(IS_STRING_STATE(state)) {
+        string_fragment(parser, state, string_start, bytes + pos - string_start, false);
         string_start = bytes + pos + 1;
-        break;
       }
+      if(parser->emit_nul)
+        do_control(parser, c);
+      break;
 
-      /* else fallthrough */
-      string_start = bytes + pos;
-      string_len   = 0;
-      vt->parser.state = OSC;
-      goto string_state;
+    case ACT_CANCEL:
+      string_start = NULL;
+      if(parser->emit_nul)
+        do_control(parser, c);
+      break;
 
-    case DCS_COMMAND:
-      if(vt->parser.v.dcs.commandlen < CSI_LEADER_MAX)
-        vt->parser.v.dcs.command[vt->parser.v.dcs.commandlen++] = c;
+    case ACT_ESC:
+      parser->intermedlen = 0;
+      break;
 
-      if(c >= 0x40 && c<= 0x7e) {
-        string_start = bytes + pos + 1;
-        vt->parser.state = DCS;
-      }
+    case ACT_CONTROL:
+      do_control(parser, c);
       break;
 
-string_state:
-    case OSC:
-    case DCS:
-    case APC:
-    case PM:
-    case SOS:
-      if(c == 0x07 || (c1_allowed && c == 0x9c)) {
-        string_fragment(vt, string_start, string_len, true);
-        ENTER_NORMAL_STATE();
-      }
+    case ACT_STRING_CONTROL:
+      string_fragment(parser, state, string_start, bytes + pos - string_start, false);
+      do_control(parser, c);
+      string_start = bytes + pos + 1;
       break;
 
-    case NORMAL:
-      if(vt->parser.in_esc) {
-        if(is_intermed(c)) {
-          if(vt->parser.intermedlen < INTERMED_MAX-1)
-            vt->parser.intermed[vt->parser.intermedlen++] = c;
-        }
-        else if(c >= 0x30 && c < 0x7f) {
-          do_escape(vt, c);
-          vt->parser.in_esc = 0;
-          ENTER_NORMAL_STATE();
-        }
-        else {
-          DEBUG_LOG("TODO: Unhandled byte %02x in Escape\n", c);
-        }
-        break;
-      }
-      if(c1_allowed && c >= 0x80 && c < 0xa0) {
-        switch(c) {
-        case 0x90: // DCS
-          vt->parser.string_initial = true;
-          vt->parser.v.dcs.commandlen = 0;
-          ENTER_STATE(DCS_COMMAND);
-          break;
-        case 0x98: // SOS
-          vt->parser.string_initial = true;
-          ENTER_STATE(SOS);
-          string_start = bytes + pos + 1;
-          string_len = 0;
-          break;
-        case 0x9b: // CSI
-          vt->parser.v.csi.leaderlen = 0;
-          ENTER_STATE(CSI_LEADER);
-          break;
-        case 0x9d: // OSC
-          vt->parser.v.osc.command = -1;
-          vt->parser.string_initial = true;
-          string_start = bytes + pos + 1;
-          ENTER_STATE(OSC_COMMAND);
-          break;
-        case 0x9e: // PM
-          vt->parser.string_initial = true;
-          ENTER_STATE(PM);
-          string_start = bytes + pos + 1;
-          string_len = 0;
-          break;
-        case 0x9f: // APC
-          vt->parser.string_initial = true;
-          ENTER_STATE(APC);
-          string_start = bytes + pos + 1;
-          string_len = 0;
-          break;
-        default:
-          do_control(vt, c);
-          break;
+    case ACT_TEXT:
+      if(pulling) {
+        /* Text runs up to the next C0, DEL, or C1 if those are recognised */
+        VTermParserEvent *ev = push_event(parser, VTERM_PARSER_EVENT_TEXT);
+        size_t end = pos + 1;
+        while(end < len) {
+          unsigned char b = bytes[end];
+          if(b < 0x20 || b == 0x7f || (b >= 0x80 && b < 0xa0 && !parser->utf8))
+            break;
+          end++;
         }
+        ev->v.text.bytes = bytes + pos;
+        ev->v.text.len   = end - pos;
+        pos = end - 1;
       }
       else {
         size_t eaten = 0;
-        if(vt->parser.callbacks && vt->parser.callbacks->text)
-          eaten = (*vt->parser.callbacks->text)(bytes + pos, len - pos, vt->parser.cbdata);
+        if(parser->callbacks && parser->callbacks->text)
+          eaten = (*parser->callbacks->text)(bytes + pos, len - pos, parser->cbdata);
 
         if(!eaten) {
           DEBUG_LOG("libvterm: Text callback did not consume any input\n");
@@ -372,27 +754,303 @@ string_state:
         pos += (eaten - 1); // we'll ++ it again in a moment
       }
       break;
+
+    case ACT_C1_ESCAPE:
+      // Hoist an ESC letter into a C1, even in UTF-8 mode
+      c += 0x40;
+      class = byte_class[c];
+      state = trans->next;
+      goto dispatch;
+
+    case ACT_STRING_ABORT:
+      string_start = NULL;
+      DEBUG_LOG("TODO: Unhandled byte %02x in Escape\n", c);
+      break;
+
+    case ACT_ESC_INTER:
+      string_start = NULL;
+      if(parser->intermedlen < INTERMED_MAX-1)
+        parser->intermed[parser->intermedlen++] = c;
+      break;
+
+    case ACT_ESC_DISPATCH:
+      string_start = NULL;
+      do_escape(parser, c);
+      break;
+
+    case ACT_CSI_START:
+      csi_key = NULL;
+      if(parser->csi_cache) {
+        unsigned int hash;
+        size_t keylen = csi_cache_key(bytes + pos + 1, len - pos - 1, &hash);
+        if(keylen) {
+          struct VTermCSICache *cache = parser->csi_cache;
+          CSICacheEntry *entry = &cache->entries[hash];
+
+          if(entry->keylen == keylen && memcmp(entry->key, bytes + pos + 1, keylen) == 0) {
+            cache->hits++;
+
+            /* Fixed size copies are cheaper than working out the lengths */
+            memcpy(parser->v.csi.leader, entry->leader, CSI_LEADER_MAX);
+            parser->v.csi.leaderlen = entry->leaderlen;
+            memcpy(parser->intermed, entry->intermed, INTERMED_MAX);
+            parser->intermedlen = entry->intermedlen;
+            memcpy(parser->v.csi.args, entry->args, sizeof(entry->args));
+            parser->v.csi.argi = entry->argi;
+
+            pos += keylen;
+            do_csi(parser, bytes[pos]);
+            state = NORMAL;
+            goto next_byte;
+          }
+
+          cache->misses++;
+          csi_key    = bytes + pos + 1;
+          csi_keylen = keylen;
+          csi_slot   = entry;
+        }
+      }
+
+      parser->v.csi.leaderlen = 0;
+      parser->v.csi.argi = 0;
+      parser->v.csi.args[0] = CSI_ARG_MISSING;
+      break;
+
+    case ACT_CSI_LEADER:
+      /* Extract leader bytes 0x3c to 0x3f */
+      if(parser->v.csi.leaderlen < CSI_LEADER_MAX-1)
+        parser->v.csi.leader[parser->v.csi.leaderlen++] = c;
+      break;
+
+    case ACT_CSI_DIGIT:
+      /* Numerical value of argument; take in all its digits at once */
+      {
+        long *arg = &parser->v.csi.args[parser->v.csi.argi];
+        long val = (*arg == CSI_ARG_MISSING) ? 0 : *arg;
+
+        val = val * 10 + (c - '0');
+        while(pos + 1 < len && bytes[pos + 1] >= '0' && bytes[pos + 1] <= '9')
+          val = val * 10 + (bytes[++pos] - '0');
+
+        *arg = val;
+      }
+      break;
+
+    case ACT_CSI_COLON:
+      parser->v.csi.args[parser->v.csi.argi] |= CSI_ARG_FLAG_MORE;
+      /* fallthrough */
+    case ACT_CSI_SEMI:
+      /* Arguments beyond the last slot all land in it */
+      if(parser->v.csi.argi < CSI_ARGS_MAX-1)
+        parser->v.csi.argi++;
+      parser->v.csi.args[parser->v.csi.argi] = CSI_ARG_MISSING;
+      break;
+
+    case ACT_CSI_ARGS_INTER:
+    case ACT_CSI_ARGS_FINAL:
+      parser->v.csi.argi++;
+      parser->intermedlen = 0;
+      if(trans->action == ACT_CSI_ARGS_FINAL)
+        goto csi_dispatch;
+      /* fallthrough */
+    case ACT_CSI_INTER:
+      if(parser->intermedlen < INTERMED_MAX-1)
+        parser->intermed[parser->intermedlen++] = c;
+      break;
+
+    case ACT_CSI_DISPATCH:
+csi_dispatch:
+      parser->v.csi.leader[parser->v.csi.leaderlen] = 0;
+      parser->intermed[parser->intermedlen] = 0;
+
+      /* Only remember it if the sequence looked ahead at ends here */
+      if(csi_key && csi_key + csi_keylen == bytes + pos + 1) {
+        csi_slot->keylen = csi_keylen;
+        memcpy(csi_slot->key, csi_key, csi_keylen);
+        csi_slot->leaderlen = parser->v.csi.leaderlen;
+        memcpy(csi_slot->leader, parser->v.csi.leader, CSI_LEADER_MAX);
+        csi_slot->intermedlen = parser->intermedlen;
+        memcpy(csi_slot->intermed, parser->intermed, INTERMED_MAX);
+        csi_slot->argi = parser->v.csi.argi;
+        memcpy(csi_slot->args, parser->v.csi.args, sizeof(csi_slot->args));
+      }
+      csi_key = NULL;
+
+      do_csi(parser, c);
+      break;
+
+    case ACT_DCS_START:
+      parser->string_initial = true;
+      parser->v.dcs.commandlen = 0;
+      break;
+
+    case ACT_DCS_COMMAND:
+    case ACT_DCS_COMMAND_END:
+      if(parser->v.dcs.commandlen < CSI_LEADER_MAX)
+        parser->v.dcs.command[parser->v.dcs.commandlen++] = c;
+      if(trans->action == ACT_DCS_COMMAND_END)
+        string_start = bytes + pos + 1;
+      break;
+
+    case ACT_OSC_START:
+      parser->v.osc.command = -1;
+      parser->string_initial = true;
+      break;
+
+    case ACT_OSC_DIGIT:
+      /* Numerical value of command */
+      if(parser->v.osc.command == -1)
+        parser->v.osc.command = 0;
+      else
+        parser->v.osc.command *= 10;
+      parser->v.osc.command += c - '0';
+      break;
+
+    case ACT_OSC_SEMI:
+      string_start = bytes + pos + 1;
+      break;
+
+    case ACT_OSC_STRING:
+      string_start = bytes + pos;
+      break;
+
+    case ACT_OSC_EMPTY:
+      /* An OSC terminated before its command is complete */
+      string_fragment(parser, OSC, bytes + pos, 0, true);
+      string_start = NULL;
+      break;
+
+    case ACT_STRING_START:
+      parser->string_initial = true;
+      string_start = bytes + pos + 1;
+      break;
+
+    case ACT_STRING_END:
+      string_fragment(parser, state, string_start, bytes + pos - string_start, true);
+      string_start = NULL;
+      break;
+
+    case ACT_STRING_ESC_END:
+      {
+        /* Leave out the ESC, unless an earlier write already sent it */
+        size_t string_len = bytes + pos - string_start;
+        if(string_len)
+          string_len -= 1;
+        string_fragment(parser, state, string_start, string_len, true);
+        string_start = NULL;
+      }
+      break;
+    }
+
+    /* Most bytes leave the state alone. Testing for that rather than always
+     * assigning lets the CPU predict the next state instead of waiting on the
+     * table load */
+    if(trans->next != state)
+      state = trans->next;
+
+next_byte:
+    if(pulling && parser->pull->full) {
+      pos++;
+      break;
     }
   }
 
-  if(string_start) {
+  parser->state = state;
+
+  if(string_start && pos == len) {
     size_t string_len = bytes + pos - string_start;
-    if(vt->parser.in_esc)
+    if(IS_STRING_ESC_STATE(state) && string_len)
       string_len -= 1;
-    string_fragment(vt, string_start, string_len, false);
+    string_fragment(parser, state, string_start, string_len, false);
   }
 
-  return len;
+  return pos;
+}
+
+INTERNAL void vterm_parser_free_buffers(VTermParser *parser)
+{
+  if(parser->pull)
+    parser_free(parser, parser->pull);
+  if(parser->csi_cache)
+    parser_free(parser, parser->csi_cache);
+  if(parser->whole.buffer)
+    parser_free(parser, parser->whole.buffer);
+
+  parser->pull = NULL;
+  parser->csi_cache = NULL;
+  parser->whole.buffer = NULL;
+}
+
+size_t vterm_input_write(VTerm *vt, const char *bytes, size_t len)
+{
+  return parse(&vt->parser, bytes, len);
+}
+
+size_t vterm_parser_write(VTermParser *parser, const char *bytes, size_t len)
+{
+  return parse(parser, bytes, len);
+}
+
+void vterm_parser_feed(VTerm *vt, const char *bytes, size_t len)
+{
+  VTermParser *parser = &vt->parser;
+
+  if(!parser->pull)
+    parser->pull = parser_malloc(parser, sizeof(struct VTermParserPull));
+
+  parser->pull->bytes = bytes;
+  parser->pull->len   = len;
+  parser->pull->pos   = 0;
+  parser->pull->nevents = parser->pull->nextevent = 0;
+  parser->pull->full  = false;
+}
+
+bool vterm_parser_next_event(VTerm *vt, VTermParserEvent *ev)
+{
+  VTermParser *parser = &vt->parser;
+  struct VTermParserPull *pull = parser->pull;
+
+  if(!pull)
+    return false;
+
+  if(pull->nextevent == pull->nevents) {
+    pull->nevents = pull->nextevent = 0;
+    pull->full = false;
+
+    /* The last parse may have reached the end of the buffer without giving
+     * any events */
+    while(!pull->nevents) {
+      if(pull->pos == pull->len)
+        return false;
+
+      parser->pulling = true;
+      pull->pos += parse(parser, pull->bytes + pull->pos, pull->len - pull->pos);
+      parser->pulling = false;
+    }
+  }
+
+  *ev = pull->events[pull->nextevent++];
+  return true;
 }
 
 void vterm_parser_set_callbacks(VTerm *vt, const VTermParserCallbacks *callbacks, void *user)
 {
+  /* A journal being recorded stays in front of whatever is set */
+  if(vt->journal.func) {
+    vt->journal.callbacks = callbacks;
+    vt->journal.cbdata = user;
+    return;
+  }
+
   vt->parser.callbacks = callbacks;
   vt->parser.cbdata = user;
 }
 
 void *vterm_parser_get_cbdata(VTerm *vt)
 {
+  if(vt->journal.func)
+    return vt->journal.cbdata;
+
   return vt->parser.cbdata;
 }
 
@@ -400,3 +1058,50 @@ void vterm_parser_set_emit_nul(VTerm *vt, bool emit)
 {
   vt->parser.emit_nul = emit;
 }
+
+void vterm_parser_set_whole_strings(VTerm *vt, size_t max_bytes)
+{
+  VTermParser *parser = &vt->parser;
+
+  /* A string already begun carries on as it started; the new size applies
+   * from the next one */
+  parser->whole.max = max_bytes;
+
+  if(!max_bytes && !parser->whole.limit && parser->whole.buffer) {
+    parser_free(parser, parser->whole.buffer);
+    parser->whole.buffer = NULL;
+    parser->whole.size = 0;
+  }
+}
+
+bool vterm_parser_is_idle(VTerm *vt)
+{
+  return vt->parser.state == NORMAL;
+}
+
+size_t vterm_parser_get_string_discarded(const VTerm *vt)
+{
+  return vt->parser.string_discarded;
+}
+
+void vterm_parser_set_csi_cache(VTerm *vt, bool enabled)
+{
+  VTermParser *parser = &vt->parser;
+
+  if(enabled && !parser->csi_cache)
+    parser->csi_cache = parser_malloc(parser, sizeof(struct VTermCSICache));
+  else if(!enabled && parser->csi_cache) {
+    parser_free(parser, parser->csi_cache);
+    parser->csi_cache = NULL;
+  }
+}
+
+void vterm_parser_get_csi_cache_stats(VTerm *vt, unsigned long *hits, unsigned long *misses)
+{
+  struct VTermCSICache *cache = vt->parser.csi_cache;
+
+  if(hits)
+    *hits = cache ? cache->hits : 0;
+  if(misses)
+    *misses = cache ? cache->misses : 0;
+}
@@ -116,8 +116,46 @@ static int lookup_colour(const VTermState *state, int palette, const long args[]
 
 // Some conveniences
 
+/* True if the callbacks take the whole pen at once through 'setpen', rather
+ * than each attribute through 'setpenattr' */
+static bool want_setpen(const VTermState *state)
+{
+  return state->screen || (state->callbacks && state->callbacks->setpen);
+}
+
+static bool pen_equal(const VTermPen *a, const VTermPen *b)
+{
+  return a->bold      == b->bold      &&
+         a->underline == b->underline &&
+         a->italic    == b->italic    &&
+         a->blink     == b->blink     &&
+         a->reverse   == b->reverse   &&
+         a->conceal   == b->conceal   &&
+         a->strike    == b->strike    &&
+         a->font      == b->font      &&
+         a->small     == b->small     &&
+         a->baseline  == b->baseline  &&
+         vterm_color_is_equal(&a->fg, &b->fg) &&
+         vterm_color_is_equal(&a->bg, &b->bg);
+}
+
+/* Gives the whole pen to 'setpen' if it differs from the old one */
+static void setpen(VTermState *state, const VTermPen *old)
+{
+  if(old && pen_equal(old, &state->pen))
+    return;
+
+  if(state->screen)
+    vterm_screen_setpen(&state->pen, state->screen);
+  else
+    (*state->callbacks->setpen)(&state->pen, state->cbdata);
+}
+
 static void setpenattr(VTermState *state, VTermAttr attr, VTermValueType type, VTermValue *val)
 {
+  if(want_setpen(state))
+    return;
+
 #ifdef DEBUG
   if(type != vterm_get_attr_type(attr)) {
     DEBUG_LOG("Cannot set attr %d as it has type %d, not type %d\n",
@@ -125,7 +163,9 @@ static void setpenattr(VTermState *state, VTermAttr attr, VTermValueType type, V
     return;
   }
 #endif
-  if(state->callbacks && state->callbacks->setpenattr)
+  if(state->screen)
+    vterm_screen_setpenattr(attr, val, state->screen);
+  else if(state->callbacks && state->callbacks->setpenattr)
     (*state->callbacks->setpenattr)(attr, val, state->cbdata);
 }
 
@@ -167,7 +207,7 @@ INTERNAL void vterm_state_newpen(VTermState *state)
     lookup_default_colour_ansi(col, &state->colors[col]);
 }
 
-INTERNAL void vterm_state_resetpen(VTermState *state)
+static void resetpen(VTermState *state)
 {
   state->pen.bold = 0;      setpenattr_bool(state, VTERM_ATTR_BOLD, 0);
   state->pen.underline = 0; setpenattr_int (state, VTERM_ATTR_UNDERLINE, 0);
@@ -184,11 +224,34 @@ INTERNAL void vterm_state_resetpen(VTermState *state)
   state->pen.bg = state->default_bg;  setpenattr_col(state, VTERM_ATTR_BACKGROUND, state->default_bg);
 }
 
+INTERNAL void vterm_state_resetpen(VTermState *state)
+{
+  if(!want_setpen(state)) {
+    resetpen(state);
+    return;
+  }
+
+  VTermPen old = state->pen;
+  resetpen(state);
+  setpen(state, &old);
+}
+
+INTERNAL void vterm_state_initpen(VTermState *state)
+{
+  if(want_setpen(state))
+    setpen(state, NULL);
+}
+
 INTERNAL void vterm_state_savepen(VTermState *state, int save)
 {
   if(save) {
     state->saved.pen = state->pen;
   }
+  else if(want_setpen(state)) {
+    VTermPen old = state->pen;
+    state->pen = state->saved.pen;
+    setpen(state, &old);
+  }
   else {
     state->pen = state->saved.pen;
 
@@ -252,6 +315,16 @@ void vterm_state_set_default_colors(VTermState *state, const VTermColor *default
     state->default_bg.type = (state->default_bg.type & ~VTERM_COLOR_DEFAULT_MASK)
                            | VTERM_COLOR_DEFAULT_BG;
   }
+
+  /* The current and saved pens take on the new defaults where they use them,
+   * as the whole pen is handed on again at the next change */
+  VTermPen *pens[] = { &state->pen, &state->saved.pen };
+  for(int i = 0; i < 2; i++) {
+    if(default_fg && VTERM_COLOR_IS_DEFAULT_FG(&pens[i]->fg))
+      pens[i]->fg = state->default_fg;
+    if(default_bg && VTERM_COLOR_IS_DEFAULT_BG(&pens[i]->bg))
+      pens[i]->bg = state->default_bg;
+  }
 }
 
 void vterm_state_set_palette_color(VTermState *state, int index, const VTermColor *col)
@@ -273,9 +346,8 @@ void vterm_state_set_bold_highbright(VTermState *state, int bold_is_highbright)
   state->bold_is_highbright = bold_is_highbright;
 }
 
-INTERNAL void vterm_state_setpen(VTermState *state, const long args[], int argcount)
+static void setpen_args(VTermState *state, const long args[], int argcount)
 {
-  // SGR - ECMA-48 8.3.117
 
   int argi = 0;
   int value;
@@ -289,7 +361,7 @@ INTERNAL void vterm_state_setpen(VTermState *state, const long args[], int argco
     switch(arg = CSI_ARG(args[argi])) {
     case CSI_ARG_MISSING:
     case 0: // Reset
-      vterm_state_resetpen(state);
+      resetpen(state);
       break;
 
     case 1: { // Bold on
@@ -468,6 +540,20 @@ INTERNAL void vterm_state_setpen(VTermState *state, const long args[], int argco
   }
 }
 
+INTERNAL void vterm_state_setpen(VTermState *state, const long args[], int argcount)
+{
+  // SGR - ECMA-48 8.3.117
+
+  if(!want_setpen(state)) {
+    setpen_args(state, args, argcount);
+    return;
+  }
+
+  VTermPen old = state->pen;
+  setpen_args(state, args, argcount);
+  setpen(state, &old);
+}
+
 static int vterm_state_getpen_color(const VTermColor *col, int argi, long args[], int fg)
 {
     /* Do nothing if the given color is the default color */
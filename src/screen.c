@@ -11,7 +11,7 @@
 
 #undef DEBUG_REFLOW
 
-/* State of the pen at some moment in time, also used in a cell */
+/* State of the pen at some moment in time, also interned for use by cells */
 typedef struct
 {
   /* After the bitfield */
@@ -27,19 +27,37 @@ typedef struct
   unsigned int font      : 4; /* 0 to 9 */
   unsigned int small     : 1;
   unsigned int baseline  : 2;
+} ScreenPen;
+
+/* Internal representation of a screen cell. Only the first codepoint is
+ * stored inline; cells with combining characters refer to a sequence in the
+ * screen's combined table instead. The pen is an index into the screen's
+ * interned pen table */
+typedef struct
+{
+  uint32_t ch; /* 0 = erased, -1 = right half of a wide char, or see CELL_COMBINED */
+  unsigned int pen            : 24;
 
   /* Extra state storage that isn't strictly pen-related */
   unsigned int protected_cell : 1;
   unsigned int dwl            : 1; /* on a DECDWL or DECDHL line */
   unsigned int dhl            : 2; /* on a DECDHL line (1=top 2=bottom) */
-} ScreenPen;
+} ScreenCell;
+
+/* Set in ScreenCell.ch when the remaining bits index screen->combined */
+#define CELL_COMBINED 0x80000000
+#define CELL_IS_COMBINED(ch)  ((ch) != (uint32_t)-1 && ((ch) & CELL_COMBINED))
 
-/* Internal representation of a screen cell */
 typedef struct
 {
-  uint32_t chars[VTERM_MAX_CHARS_PER_CELL];
-  ScreenPen pen;
-} ScreenCell;
+  uint64_t gen;       /* generation of the latest change */
+  uint64_t span_from; /* the span covers every change after this generation */
+  int start_col, end_col;
+} ScreenRowDirty;
+
+/* The most rectangles VTERM_DAMAGE_REGION will track before it starts merging
+ * them together */
+#define DAMAGE_REGION_MAX 16
 
 struct VTermScreen
 {
@@ -54,6 +72,29 @@ struct VTermScreen
   VTermRect damaged;
   VTermRect pending_scrollrect;
   int pending_scroll_downward, pending_scroll_rightward;
+  /* For VTERM_DAMAGE_REGION; kept disjoint */
+  VTermRect damage_region[DAMAGE_REGION_MAX];
+  int damage_region_count;
+
+  /* While a synchronized update (DEC mode 2026) is being held back: the
+   * bounding rectangle of its damage, and where the cursor was when the
+   * update began and where it is now */
+  struct {
+    bool active;
+    VTermRect damaged;
+    bool cursor_moved;
+    VTermPos cursor_oldpos, cursor_pos;
+    int cursor_visible;
+    int timeout, elapsed; /* msec */
+  } sync;
+
+  /* Built-in scrollback, if enabled */
+  struct ScreenScrollback *sb_store;
+
+  /* For vterm_screen_get_dirty_rows() */
+  uint64_t generation;
+  uint64_t dirty_polled; /* generation at the last poll */
+  ScreenRowDirty *dirty;
 
   int rows;
   int cols;
@@ -61,22 +102,44 @@ struct VTermScreen
   unsigned int global_reverse : 1;
   unsigned int reflow : 1;
 
-  /* Primary and Altscreen. buffers[1] is lazily allocated as needed */
-  ScreenCell *buffers[2];
+  /* Primary and Altscreen. buffers[1] is lazily allocated as needed.
+   * Each buffer is a table of row pointers into its cells, so that full-width
+   * scrolls only have to rotate the table rather than move the cells */
+  ScreenCell **buffers[2];
 
   /* buffer will == buffers[0] or buffers[1], depending on altscreen */
-  ScreenCell *buffer;
+  ScreenCell **buffer;
 
   /* buffer for a single screen row used in scrollback storage callbacks */
   VTermScreenCell *sb_buffer;
+  /* packed row handed to sb_pushline_raw */
+  VTermScreenRow *sb_row;
+  size_t sb_row_size;
 
   ScreenPen pen;
+
+  /* Interned pens referred to by cells, and an open-addressed hash of them
+   * whose slots hold an index into pens plus one, or zero if empty */
+  ScreenPen *pens;
+  int pens_used, pens_size;
+  int *pen_hash;
+
+  /* Codepoint sequences of cells holding combining characters */
+  uint32_t (*combined)[VTERM_MAX_CHARS_PER_CELL];
+  int combined_used, combined_size;
+
+  /* Cached indexes into pens of the current pen and of the pen used for
+   * erasing, or -1 if these need interning again */
+  int pen_index;
+  int erase_pen_index;
 };
 
-static inline void clearcell(const VTermScreen *screen, ScreenCell *cell)
+static inline void clearcell(ScreenCell *cell, unsigned int pen)
 {
-  cell->chars[0] = 0;
-  cell->pen = screen->pen;
+  *cell = (ScreenCell){
+    .ch  = 0,
+    .pen = pen,
+  };
 }
 
 static inline ScreenCell *getcell(const VTermScreen *screen, int row, int col)
@@ -85,23 +148,461 @@ static inline ScreenCell *getcell(const VTermScreen *screen, int row, int col)
     return NULL;
   if(col < 0 || col >= screen->cols)
     return NULL;
-  return screen->buffer + (screen->cols * row) + col;
+  return screen->buffer[row] + col;
+}
+
+static uint32_t hash_mix(uint32_t h)
+{
+  h ^= h >> 16;
+  h *= 0x85ebca6b;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35;
+  h ^= h >> 16;
+  return h;
+}
+
+static uint32_t color_key(const VTermColor *col)
+{
+  if(VTERM_COLOR_IS_INDEXED(col))
+    return col->type | col->indexed.idx << 8;
+
+  return col->type | col->rgb.red << 8 | col->rgb.green << 16 | (uint32_t)col->rgb.blue << 24;
+}
+
+static uint32_t pen_hash(const ScreenPen *pen)
+{
+  uint32_t attrs = pen->bold | pen->underline << 1 | pen->italic << 3 |
+    pen->blink << 4 | pen->reverse << 5 | pen->conceal << 6 | pen->strike << 7 |
+    pen->font << 8 | pen->small << 12 | pen->baseline << 13;
+
+  return hash_mix(hash_mix(hash_mix(color_key(&pen->fg)) ^ color_key(&pen->bg)) ^ attrs);
+}
+
+static bool pen_equal(const ScreenPen *a, const ScreenPen *b)
+{
+  return a->bold      == b->bold &&
+         a->underline == b->underline &&
+         a->italic    == b->italic &&
+         a->blink     == b->blink &&
+         a->reverse   == b->reverse &&
+         a->conceal   == b->conceal &&
+         a->strike    == b->strike &&
+         a->font      == b->font &&
+         a->small     == b->small &&
+         a->baseline  == b->baseline &&
+         vterm_color_is_equal(&a->fg, &b->fg) &&
+         vterm_color_is_equal(&a->bg, &b->bg);
 }
 
-static ScreenCell *alloc_buffer(VTermScreen *screen, int rows, int cols)
+static void rehash_pens(VTermScreen *screen)
 {
-  ScreenCell *new_buffer = vterm_allocator_malloc(screen->vt, sizeof(ScreenCell) * rows * cols);
+  int mask = screen->pens_size * 2 - 1;
+
+  for(int slot = 0; slot <= mask; slot++)
+    screen->pen_hash[slot] = 0;
+
+  for(int i = 0; i < screen->pens_used; i++) {
+    uint32_t slot = pen_hash(&screen->pens[i]) & mask;
+    while(screen->pen_hash[slot])
+      slot = (slot + 1) & mask;
+    screen->pen_hash[slot] = i + 1;
+  }
+}
+
+static void grow_pens(VTermScreen *screen)
+{
+  int new_size = screen->pens_size * 2;
+  ScreenPen *new_pens = vterm_allocator_malloc(screen->vt, sizeof(ScreenPen) * new_size);
+
+  memcpy(new_pens, screen->pens, sizeof(ScreenPen) * screen->pens_used);
+
+  vterm_allocator_free(screen->vt, screen->pens);
+  vterm_allocator_free(screen->vt, screen->pen_hash);
+
+  screen->pens = new_pens;
+  screen->pens_size = new_size;
+  screen->pen_hash = vterm_allocator_malloc(screen->vt, sizeof(int) * new_size * 2);
+
+  rehash_pens(screen);
+}
+
+static void grow_combined(VTermScreen *screen)
+{
+  int new_size = screen->combined_size ? screen->combined_size * 2 : 16;
+  uint32_t (*new_combined)[VTERM_MAX_CHARS_PER_CELL] =
+    vterm_allocator_malloc(screen->vt, sizeof(new_combined[0]) * new_size);
+
+  if(screen->combined) {
+    memcpy(new_combined, screen->combined, sizeof(new_combined[0]) * screen->combined_used);
+    vterm_allocator_free(screen->vt, screen->combined);
+  }
+
+  screen->combined = new_combined;
+  screen->combined_size = new_size;
+}
+
+/* Drops the pens and combined sequences that nothing refers to any more, and
+ * renumbers the rest. Every cell of every buffer must hold a valid reference,
+ * so this must not run while a resize is building new buffers */
+static void collect_garbage(VTermScreen *screen)
+{
+  int *pen_map = vterm_allocator_malloc(screen->vt,
+      sizeof(int) * (screen->pens_used + screen->combined_used + 1));
+  int *combined_map = pen_map + screen->pens_used;
+
+  /* First mark everything in use with 0 ... */
+  for(int i = 0; i < screen->pens_used + screen->combined_used; i++)
+    pen_map[i] = -1;
+
+  if(screen->pen_index >= 0)
+    pen_map[screen->pen_index] = 0;
+  if(screen->erase_pen_index >= 0)
+    pen_map[screen->erase_pen_index] = 0;
+
+  for(int bufidx = 0; bufidx < 2; bufidx++) {
+    ScreenCell **buffer = screen->buffers[bufidx];
+    if(!buffer)
+      continue;
+
+    for(int row = 0; row < screen->rows; row++)
+      for(int col = 0; col < screen->cols; col++) {
+        ScreenCell *cell = &buffer[row][col];
+        pen_map[cell->pen] = 0;
+        if(CELL_IS_COMBINED(cell->ch))
+          combined_map[cell->ch & ~CELL_COMBINED] = 0;
+      }
+  }
+
+  /* ... then compact both tables, turning the marks into new indexes ... */
+  int used = 0;
+  for(int i = 0; i < screen->pens_used; i++)
+    if(pen_map[i] == 0) {
+      screen->pens[used] = screen->pens[i];
+      pen_map[i] = used++;
+    }
+  screen->pens_used = used;
+
+  used = 0;
+  for(int i = 0; i < screen->combined_used; i++)
+    if(combined_map[i] == 0) {
+      memmove(screen->combined[used], screen->combined[i], sizeof(screen->combined[0]));
+      combined_map[i] = used++;
+    }
+  screen->combined_used = used;
+
+  /* ... and finally update all the references */
+  for(int bufidx = 0; bufidx < 2; bufidx++) {
+    ScreenCell **buffer = screen->buffers[bufidx];
+    if(!buffer)
+      continue;
+
+    for(int row = 0; row < screen->rows; row++)
+      for(int col = 0; col < screen->cols; col++) {
+        ScreenCell *cell = &buffer[row][col];
+        cell->pen = pen_map[cell->pen];
+        if(CELL_IS_COMBINED(cell->ch))
+          cell->ch = CELL_COMBINED | combined_map[cell->ch & ~CELL_COMBINED];
+      }
+  }
+
+  if(screen->pen_index >= 0)
+    screen->pen_index = pen_map[screen->pen_index];
+  if(screen->erase_pen_index >= 0)
+    screen->erase_pen_index = pen_map[screen->erase_pen_index];
+
+  vterm_allocator_free(screen->vt, pen_map);
+
+  rehash_pens(screen);
+}
+
+static unsigned int intern_pen(VTermScreen *screen, const ScreenPen *pen, bool may_collect)
+{
+  uint32_t hash = pen_hash(pen);
+  int mask = screen->pens_size * 2 - 1;
+
+  for(uint32_t slot = hash & mask; screen->pen_hash[slot]; slot = (slot + 1) & mask)
+    if(pen_equal(&screen->pens[screen->pen_hash[slot] - 1], pen))
+      return screen->pen_hash[slot] - 1;
+
+  if(screen->pens_used == screen->pens_size) {
+    if(may_collect)
+      collect_garbage(screen);
+    /* Grow anyway unless that freed up most of the table, so that collections
+     * (which have to visit every cell) stay rare */
+    if(screen->pens_used >= screen->pens_size / 4)
+      grow_pens(screen);
+    mask = screen->pens_size * 2 - 1;
+  }
+
+  int index = screen->pens_used++;
+  screen->pens[index] = *pen;
+
+  uint32_t slot = hash & mask;
+  while(screen->pen_hash[slot])
+    slot = (slot + 1) & mask;
+  screen->pen_hash[slot] = index + 1;
+
+  return index;
+}
+
+/* Returns the value for ScreenCell.ch for the given (zero-terminated unless
+ * it is VTERM_MAX_CHARS_PER_CELL long) sequence of codepoints */
+static uint32_t intern_chars(VTermScreen *screen, const uint32_t chars[], bool may_collect)
+{
+  if(!chars[0] || VTERM_MAX_CHARS_PER_CELL < 2 || !chars[1])
+    return chars[0];
+
+  if(screen->combined_used == screen->combined_size) {
+    if(may_collect)
+      collect_garbage(screen);
+    if(screen->combined_used >= screen->combined_size / 4)
+      grow_combined(screen);
+  }
+
+  int index = screen->combined_used++;
+  for(int i = 0; i < VTERM_MAX_CHARS_PER_CELL; i++) {
+    screen->combined[index][i] = chars[i];
+    if(!chars[i])
+      break;
+  }
+
+  return CELL_COMBINED | index;
+}
+
+/* Fills in chars[] from the cell, zero-terminated if there is room */
+static void cell_get_chars(const VTermScreen *screen, const ScreenCell *cell, uint32_t chars[])
+{
+  if(CELL_IS_COMBINED(cell->ch)) {
+    memcpy(chars, screen->combined[cell->ch & ~CELL_COMBINED], sizeof(screen->combined[0]));
+    return;
+  }
+
+  chars[0] = cell->ch;
+  if(VTERM_MAX_CHARS_PER_CELL > 1)
+    chars[1] = 0;
+}
+
+static unsigned int current_pen(VTermScreen *screen)
+{
+  if(screen->pen_index < 0)
+    screen->pen_index = intern_pen(screen, &screen->pen, true);
+
+  return screen->pen_index;
+}
+
+static unsigned int erase_pen(VTermScreen *screen)
+{
+  if(screen->erase_pen_index < 0) {
+    ScreenPen pen = {
+      /* Only copy .fg and .bg; leave things like rv in reset state */
+      .fg = screen->pen.fg,
+      .bg = screen->pen.bg,
+    };
+    screen->erase_pen_index = intern_pen(screen, &pen, true);
+  }
+
+  return screen->erase_pen_index;
+}
+
+static ScreenCell **alloc_buffer(VTermScreen *screen, int rows, int cols)
+{
+  unsigned int pen = current_pen(screen);
+
+  /* The row table and the cells it points into share a single allocation */
+  ScreenCell **new_buffer = vterm_allocator_malloc(screen->vt,
+      sizeof(ScreenCell *) * rows + sizeof(ScreenCell) * rows * cols);
+  ScreenCell *cells = (ScreenCell *)(new_buffer + rows);
 
   for(int row = 0; row < rows; row++) {
+    new_buffer[row] = cells + row * cols;
     for(int col = 0; col < cols; col++) {
-      clearcell(screen, &new_buffer[row * cols + col]);
+      clearcell(&new_buffer[row][col], pen);
     }
   }
 
   return new_buffer;
 }
 
-static void damagerect(VTermScreen *screen, VTermRect rect)
+static void reverse_rows(ScreenCell **buffer, int start_row, int end_row)
+{
+  for(end_row--; start_row < end_row; start_row++, end_row--) {
+    ScreenCell *tmp = buffer[start_row];
+    buffer[start_row] = buffer[end_row];
+    buffer[end_row] = tmp;
+  }
+}
+
+/* Rotates the rows in [start_row, end_row) upwards by the given count, so
+ * that row start_row+upward becomes start_row and the rows that were at the
+ * top wrap around to the bottom. A negative count rotates downwards */
+static void rotate_rows(ScreenCell **buffer, int start_row, int end_row, int upward)
+{
+  int count = end_row - start_row;
+
+  upward %= count;
+  if(upward < 0)
+    upward += count;
+  if(!upward)
+    return;
+
+  reverse_rows(buffer, start_row, start_row + upward);
+  reverse_rows(buffer, start_row + upward, end_row);
+  reverse_rows(buffer, start_row, end_row);
+}
+
+static void dirty_rect(VTermScreen *screen, VTermRect rect)
+{
+  /* Damage from before a resize, flushed after it, may reach past the
+   * edges of the screen as it is now */
+  rect_clip(&rect, &(VTermRect){
+      .start_row = 0, .end_row = screen->rows,
+      .start_col = 0, .end_col = screen->cols });
+
+  if(rect.start_col >= rect.end_col)
+    return;
+
+  uint64_t gen = ++screen->generation;
+
+  int start_row = rect.start_row;
+  int end_row   = rect.end_row;
+
+  for(int row = start_row; row < end_row; row++) {
+    ScreenRowDirty *dirty = &screen->dirty[row];
+
+    if(dirty->gen <= screen->dirty_polled) {
+      /* Everything before has been reported, so start a new span */
+      dirty->span_from = screen->dirty_polled;
+      dirty->start_col = rect.start_col;
+      dirty->end_col   = rect.end_col;
+    }
+    else {
+      if(dirty->start_col > rect.start_col)
+        dirty->start_col = rect.start_col;
+      if(dirty->end_col < rect.end_col)
+        dirty->end_col = rect.end_col;
+    }
+
+    dirty->gen = gen;
+  }
+}
+
+static ScreenRowDirty *alloc_dirty(VTermScreen *screen, int rows)
+{
+  ScreenRowDirty *dirty = vterm_allocator_malloc(screen->vt, sizeof(ScreenRowDirty) * rows);
+
+  for(int row = 0; row < rows; row++)
+    dirty[row] = (ScreenRowDirty){ 0 };
+
+  return dirty;
+}
+
+/* True if the rectangles share some cells, or sit side by side along a whole
+ * edge so that together they form a larger rectangle */
+static bool damage_region_joins(const VTermRect *a, const VTermRect *b)
+{
+  bool rows_overlap = a->start_row < b->end_row && b->start_row < a->end_row;
+  bool cols_overlap = a->start_col < b->end_col && b->start_col < a->end_col;
+
+  if(rows_overlap && cols_overlap)
+    return true;
+
+  if(a->start_row == b->start_row && a->end_row == b->end_row &&
+     (a->end_col == b->start_col || b->end_col == a->start_col))
+    return true;
+
+  if(a->start_col == b->start_col && a->end_col == b->end_col &&
+     (a->end_row == b->start_row || b->end_row == a->start_row))
+    return true;
+
+  return false;
+}
+
+static int rect_area(const VTermRect *rect)
+{
+  return (rect->end_row - rect->start_row) * (rect->end_col - rect->start_col);
+}
+
+static void damage_region_add(VTermScreen *screen, VTermRect rect)
+{
+  VTermRect *region = screen->damage_region;
+
+  if(rect.start_row >= rect.end_row || rect.start_col >= rect.end_col)
+    return;
+
+again:
+  /* Absorb everything the new rectangle joins up with. Each time it grows it
+   * may reach rectangles already looked at, so start over */
+  for(int i = 0; i < screen->damage_region_count; i++) {
+    if(!damage_region_joins(&region[i], &rect))
+      continue;
+
+    rect_expand(&rect, &region[i]);
+    region[i] = region[--screen->damage_region_count];
+    i = -1;
+  }
+
+  if(screen->damage_region_count == DAMAGE_REGION_MAX) {
+    /* Out of room; merge with whichever rectangle wastes the least area */
+    int best = -1, best_waste = 0;
+    for(int i = 0; i < screen->damage_region_count; i++) {
+      VTermRect merged = rect;
+      rect_expand(&merged, &region[i]);
+      int waste = rect_area(&merged) - rect_area(&region[i]) - rect_area(&rect);
+      if(best == -1 || waste < best_waste) {
+        best = i;
+        best_waste = waste;
+      }
+    }
+
+    rect_expand(&rect, &region[best]);
+    region[best] = region[--screen->damage_region_count];
+    goto again;
+  }
+
+  region[screen->damage_region_count++] = rect;
+}
+
+static void damage_region_flush(VTermScreen *screen)
+{
+  VTermRect *region = screen->damage_region;
+  int count = 0;
+
+  /* Clip to the screen, in case it has shrunk since, and sort by position */
+  VTermRect bounds = {
+    .start_row = 0,
+    .end_row   = screen->rows,
+    .start_col = 0,
+    .end_col   = screen->cols,
+  };
+  for(int i = 0; i < screen->damage_region_count; i++) {
+    VTermRect rect = region[i];
+    rect_clip(&rect, &bounds);
+    if(rect.start_row == rect.end_row || rect.start_col == rect.end_col)
+      continue;
+
+    int j = count++;
+    for(; j > 0 && (region[j-1].start_row > rect.start_row ||
+                    (region[j-1].start_row == rect.start_row && region[j-1].start_col > rect.start_col)); j--)
+      region[j] = region[j-1];
+    region[j] = rect;
+  }
+
+  screen->damage_region_count = 0;
+
+  if(!count || !screen->callbacks)
+    return;
+
+  if(screen->callbacks->damage_region)
+    if((*screen->callbacks->damage_region)(region, count, screen->cbdata))
+      return;
+
+  if(screen->callbacks->damage)
+    for(int i = 0; i < count; i++)
+      (*screen->callbacks->damage)(region[i], screen->cbdata);
+}
+
+/* Emits or stores damage as the merge mode dictates */
+static void merge_damage(VTermScreen *screen, VTermRect rect)
 {
   VTermRect emit;
 
@@ -149,6 +650,10 @@ static void damagerect(VTermScreen *screen, VTermRect rect)
     }
     return;
 
+  case VTERM_DAMAGE_REGION:
+    damage_region_add(screen, rect);
+    return;
+
   default:
     DEBUG_LOG("TODO: Maybe merge damage for level %d\n", screen->damage_merge);
     return;
@@ -158,6 +663,21 @@ static void damagerect(VTermScreen *screen, VTermRect rect)
     (*screen->callbacks->damage)(emit, screen->cbdata);
 }
 
+static void damagerect(VTermScreen *screen, VTermRect rect)
+{
+  dirty_rect(screen, rect);
+
+  if(screen->sync.active) {
+    if(screen->sync.damaged.start_row == -1)
+      screen->sync.damaged = rect;
+    else
+      rect_expand(&screen->sync.damaged, &rect);
+    return;
+  }
+
+  merge_damage(screen, rect);
+}
+
 static void damagescreen(VTermScreen *screen)
 {
   VTermRect rect = {
@@ -170,7 +690,7 @@ static void damagescreen(VTermScreen *screen)
   damagerect(screen, rect);
 }
 
-static int putglyph(VTermGlyphInfo *info, VTermPos pos, void *user)
+INTERNAL int vterm_screen_putglyph(VTermGlyphInfo *info, VTermPos pos, void *user)
 {
   VTermScreen *screen = user;
   ScreenCell *cell = getcell(screen, pos.row, pos.col);
@@ -178,16 +698,11 @@ static int putglyph(VTermGlyphInfo *info, VTermPos pos, void *user)
   if(!cell)
     return 0;
 
-  int i;
-  for(i = 0; i < VTERM_MAX_CHARS_PER_CELL && info->chars[i]; i++) {
-    cell->chars[i] = info->chars[i];
-    cell->pen = screen->pen;
-  }
-  if(i < VTERM_MAX_CHARS_PER_CELL)
-    cell->chars[i] = 0;
+  cell->pen = current_pen(screen);
+  cell->ch  = intern_chars(screen, info->chars, true);
 
   for(int col = 1; col < info->width; col++)
-    getcell(screen, pos.row, pos.col + col)->chars[0] = (uint32_t)-1;
+    getcell(screen, pos.row, pos.col + col)->ch = (uint32_t)-1;
 
   VTermRect rect = {
     .start_row = pos.row,
@@ -196,17 +711,301 @@ static int putglyph(VTermGlyphInfo *info, VTermPos pos, void *user)
     .end_col   = pos.col+info->width,
   };
 
-  cell->pen.protected_cell = info->protected_cell;
-  cell->pen.dwl            = info->dwl;
-  cell->pen.dhl            = info->dhl;
+  cell->protected_cell = info->protected_cell;
+  cell->dwl            = info->dwl;
+  cell->dhl            = info->dhl;
 
   damagerect(screen, rect);
 
   return 1;
 }
 
+INTERNAL int vterm_screen_putglyphs(const VTermGlyphInfo info[], int count, VTermPos pos, void *user)
+{
+  VTermScreen *screen = user;
+
+  int end_col = pos.col;
+  for(int i = 0; i < count; i++)
+    end_col += info[i].width;
+
+  if(pos.row < 0 || pos.row >= screen->rows || pos.col < 0 || end_col > screen->cols)
+    return 0;
+
+  ScreenCell *row = screen->buffer[pos.row];
+  int col = pos.col;
+  uint32_t ch = 0;
+
+  /* Intern the pen up front, so that only interning chars can collect
+   * garbage from here on. A collection keeps screen->pen_index up to date,
+   * but would leave a saved ch pointing at the wrong sequence */
+  current_pen(screen);
+
+  for(int i = 0; i < count; i++) {
+    ScreenCell *cell = &row[col];
+
+    /* Glyphs sharing their chars, as a repeat does, share the interned
+     * value too */
+    if(!i || info[i].chars != info[i-1].chars)
+      ch = intern_chars(screen, info[i].chars, true);
+
+    cell->ch             = ch;
+    cell->pen            = screen->pen_index;
+    cell->protected_cell = info[i].protected_cell;
+    cell->dwl            = info[i].dwl;
+    cell->dhl            = info[i].dhl;
+
+    for(int c = 1; c < info[i].width; c++)
+      cell[c].ch = (uint32_t)-1;
+
+    col += info[i].width;
+  }
+
+  VTermRect rect = {
+    .start_row = pos.row,
+    .end_row   = pos.row+1,
+    .start_col = pos.col,
+    .end_col   = end_col,
+  };
+
+  if(screen->damage_merge != VTERM_DAMAGE_CELL || screen->sync.active)
+    damagerect(screen, rect);
+  else if(screen->callbacks && screen->callbacks->damage) {
+    /* CELL mode still reports each glyph as damage of its own */
+    for(int i = 0; i < count; i++) {
+      rect.end_col = rect.start_col + info[i].width;
+      damagerect(screen, rect);
+      rect.start_col = rect.end_col;
+    }
+  }
+  else
+    dirty_rect(screen, rect);
+
+  return 1;
+}
+
+/* Packed rows, as described by VTermScreenRow in vterm.h. These are handed to
+ * sb_pushline_raw and are also the form lines take in the built-in scrollback
+ * store
+ */
+static bool row_cells_same_run(const ScreenCell *a, const ScreenCell *b)
+{
+  return a->pen == b->pen && a->dwl == b->dwl && a->dhl == b->dhl;
+}
+
+/* Erased cells at the end of the row in the same run as the last cell carry
+ * no text */
+static int row_text_cells(const ScreenCell *cells, int cols)
+{
+  int textcells = cols;
+  while(textcells > 0 && cells[textcells-1].ch == 0 &&
+        row_cells_same_run(&cells[textcells-1], &cells[cols-1]))
+    textcells--;
+
+  return textcells;
+}
+
+/* Fills in the header for a packed copy of cells and returns its size */
+static size_t row_measure(const VTermScreen *screen, const ScreenCell *cells, int cols, VTermScreenRow *row)
+{
+  int textcells = row_text_cells(cells, cols);
+
+  row->cols    = cols;
+  row->nruns   = 0;
+  row->textlen = 0;
+
+  for(int col = 0; col < cols; col++) {
+    if(!col || !row_cells_same_run(&cells[col], &cells[col-1]))
+      row->nruns++;
+
+    if(col >= textcells)
+      continue;
+
+    if(cells[col].ch == 0 || cells[col].ch == (uint32_t)-1) {
+      row->textlen++;
+      continue;
+    }
+
+    uint32_t chars[VTERM_MAX_CHARS_PER_CELL];
+    cell_get_chars(screen, &cells[col], chars);
+    for(int i = 0; i < VTERM_MAX_CHARS_PER_CELL && chars[i]; i++)
+      row->textlen += (i ? 1 : 0) + utf8_seqlen(chars[i]);
+  }
+
+  return vterm_screen_row_size(row);
+}
+
+/* Fills in the runs and text of a row whose header row_measure() set */
+static void row_pack(const VTermScreen *screen, const ScreenCell *cells, VTermScreenRow *row, bool reverse)
+{
+  int textcells = row_text_cells(cells, row->cols);
+
+  VTermScreenRowRun *run = (VTermScreenRowRun *)vterm_screen_row_runs(row) - 1;
+  unsigned char *text = (unsigned char *)vterm_screen_row_text(row);
+
+  for(int col = 0; col < row->cols; col++) {
+    if(!col || !row_cells_same_run(&cells[col], &cells[col-1])) {
+      const ScreenPen *pen = &screen->pens[cells[col].pen];
+
+      run++;
+      /* Zero any padding too, so that packed rows compare and compress well */
+      memset(run, 0, sizeof(*run));
+      run->attrs.bold      = pen->bold;
+      run->attrs.underline = pen->underline;
+      run->attrs.italic    = pen->italic;
+      run->attrs.blink     = pen->blink;
+      run->attrs.reverse   = pen->reverse ^ reverse;
+      run->attrs.conceal   = pen->conceal;
+      run->attrs.strike    = pen->strike;
+      run->attrs.font      = pen->font;
+      run->attrs.small     = pen->small;
+      run->attrs.baseline  = pen->baseline;
+      run->attrs.dwl       = cells[col].dwl;
+      run->attrs.dhl       = cells[col].dhl;
+      run->fg = pen->fg;
+      run->bg = pen->bg;
+    }
+    run->cells++;
+
+    if(col >= textcells)
+      continue;
+
+    if(cells[col].ch == 0)
+      *(text++) = VTERM_ROW_TEXT_ERASED;
+    else if(cells[col].ch == (uint32_t)-1)
+      *(text++) = VTERM_ROW_TEXT_WIDE_GAP;
+    else {
+      uint32_t chars[VTERM_MAX_CHARS_PER_CELL];
+      cell_get_chars(screen, &cells[col], chars);
+      for(int i = 0; i < VTERM_MAX_CHARS_PER_CELL && chars[i]; i++) {
+        if(i)
+          *(text++) = VTERM_ROW_TEXT_COMBINING;
+        text += fill_utf8(chars[i], (char *)text);
+      }
+    }
+  }
+}
+
+static int row_text_decode(const unsigned char *text, uint32_t *cp)
+{
+  unsigned char c = text[0];
+  int nbytes = c < 0x80 ? 1 : c < 0xe0 ? 2 : c < 0xf0 ? 3 : c < 0xf8 ? 4 : c < 0xfc ? 5 : 6;
+
+  *cp = nbytes == 1 ? c : c & (0x7f >> nbytes);
+  for(int i = 1; i < nbytes; i++)
+    *cp = (*cp << 6) | (text[i] & 0x3f);
+
+  return nbytes;
+}
+
+/* Built-in scrollback store
+ *
+ * Each line is one allocation holding a packed row. Reverse video is stored
+ * as the pen had it; DECSCNM is applied when lines are read back out.
+ */
+struct ScreenScrollback
+{
+  VTermScreenRow **lines; /* ring buffer, oldest at ->head */
+  int    size;
+  int    head;
+  int    count;
+  size_t bytes;
+  size_t max_bytes;
+};
+
+/* Line 0 is the most recently pushed */
+static VTermScreenRow *sb_store_line(const struct ScreenScrollback *sb, int line)
+{
+  if(line < 0 || line >= sb->count)
+    return NULL;
+
+  return sb->lines[(sb->head + sb->count - 1 - line) % sb->size];
+}
+
+static void sb_store_drop_oldest(VTermScreen *screen)
+{
+  struct ScreenScrollback *sb = screen->sb_store;
+  VTermScreenRow *line = sb->lines[sb->head];
+
+  sb->bytes -= vterm_screen_row_size(line) + sizeof(sb->lines[0]);
+  vterm_allocator_free(screen->vt, line);
+
+  sb->head = (sb->head + 1) % sb->size;
+  sb->count--;
+}
+
+static void sb_store_push(VTermScreen *screen, const ScreenCell *cells, int cols)
+{
+  struct ScreenScrollback *sb = screen->sb_store;
+
+  VTermScreenRow header;
+  size_t size = row_measure(screen, cells, cols, &header);
+
+  VTermScreenRow *line = vterm_allocator_malloc(screen->vt, size);
+  *line = header;
+  row_pack(screen, cells, line, false);
+
+  if(sb->count == sb->size) {
+    int newsize = sb->size ? sb->size * 2 : 64;
+    VTermScreenRow **newlines = vterm_allocator_malloc(screen->vt, sizeof(newlines[0]) * newsize);
+    for(int i = 0; i < sb->count; i++)
+      newlines[i] = sb->lines[(sb->head + i) % sb->size];
+    if(sb->lines)
+      vterm_allocator_free(screen->vt, sb->lines);
+    sb->lines = newlines;
+    sb->size  = newsize;
+    sb->head  = 0;
+  }
+
+  sb->lines[(sb->head + sb->count) % sb->size] = line;
+  sb->count++;
+  sb->bytes += size + sizeof(sb->lines[0]);
+
+  while(sb->count && sb->bytes > sb->max_bytes)
+    sb_store_drop_oldest(screen);
+}
+
+static void sb_store_get_cells(const VTermScreen *screen, const VTermScreenRow *line, VTermScreenCell cells[], int cols)
+{
+  vterm_screen_row_get_cells(line, cells, cols);
+
+  if(screen->global_reverse)
+    for(int col = 0; col < cols; col++)
+      cells[col].attrs.reverse ^= 1;
+}
+
+static bool sb_enabled(const VTermScreen *screen)
+{
+  return screen->sb_store ||
+    (screen->callbacks && (screen->callbacks->sb_pushline || screen->callbacks->sb_pushline_raw));
+}
+
 static void sb_pushline_from_row(VTermScreen *screen, int row)
 {
+  if(screen->sb_store) {
+    sb_store_push(screen, screen->buffer[row], screen->cols);
+    return;
+  }
+
+  if(screen->callbacks->sb_pushline_raw) {
+    VTermScreenRow header;
+    size_t size = row_measure(screen, screen->buffer[row], screen->cols, &header);
+    if(size > screen->sb_row_size) {
+      if(screen->sb_row)
+        vterm_allocator_free(screen->vt, screen->sb_row);
+      screen->sb_row = vterm_allocator_malloc(screen->vt, size);
+      screen->sb_row_size = size;
+    }
+
+    *screen->sb_row = header;
+    row_pack(screen, screen->buffer[row], screen->sb_row, screen->global_reverse);
+
+    if((*screen->callbacks->sb_pushline_raw)(screen->sb_row, screen->cbdata))
+      return;
+  }
+
+  if(!screen->callbacks->sb_pushline)
+    return;
+
   VTermPos pos = { .row = row };
   for(pos.col = 0; pos.col < screen->cols; pos.col++)
     vterm_screen_get_cell(screen, pos, screen->sb_buffer + pos.col);
@@ -214,11 +1013,33 @@ static void sb_pushline_from_row(VTermScreen *screen, int row)
   (screen->callbacks->sb_pushline)(screen->cols, screen->sb_buffer, screen->cbdata);
 }
 
+static int sb_popline(VTermScreen *screen, int cols, VTermScreenCell *cells)
+{
+  if(screen->sb_store) {
+    struct ScreenScrollback *sb = screen->sb_store;
+    VTermScreenRow *line = sb_store_line(sb, 0);
+    if(!line)
+      return 0;
+
+    sb_store_get_cells(screen, line, cells, cols);
+
+    sb->count--;
+    sb->bytes -= vterm_screen_row_size(line) + sizeof(sb->lines[0]);
+    vterm_allocator_free(screen->vt, line);
+    return 1;
+  }
+
+  if(screen->callbacks && screen->callbacks->sb_popline)
+    return (*screen->callbacks->sb_popline)(cols, cells, screen->cbdata);
+
+  return 0;
+}
+
 static int moverect_internal(VTermRect dest, VTermRect src, void *user)
 {
   VTermScreen *screen = user;
 
-  if(screen->callbacks && screen->callbacks->sb_pushline &&
+  if(sb_enabled(screen) &&
      dest.start_row == 0 && dest.start_col == 0 &&        // starts top-left corner
      dest.end_col == screen->cols &&                      // full width
      screen->buffer == screen->buffers[BUFIDX_PRIMARY]) { // not altscreen
@@ -229,6 +1050,17 @@ static int moverect_internal(VTermRect dest, VTermRect src, void *user)
   int cols = src.end_col - src.start_col;
   int downward = src.start_row - dest.start_row;
 
+  if(dest.start_col == 0 && dest.end_col == screen->cols && downward) {
+    /* A full-width vertical scroll only needs to rotate the row table. The
+     * rows that wrap around still hold their old content, but the caller
+     * always erases the vacated area straight after moving */
+    int start_row = downward > 0 ? dest.start_row : src.start_row;
+    int end_row   = downward > 0 ? src.end_row    : dest.end_row;
+
+    rotate_rows(screen->buffer, start_row, end_row, downward);
+    return 1;
+  }
+
   int init_row, test_row, inc_row;
   if(downward < 0) {
     init_row = dest.end_row - 1;
@@ -270,6 +1102,7 @@ static int moverect_user(VTermRect dest, VTermRect src, void *user)
 static int erase_internal(VTermRect rect, int selective, void *user)
 {
   VTermScreen *screen = user;
+  unsigned int pen = erase_pen(screen);
 
   for(int row = rect.start_row; row < screen->state->rows && row < rect.end_row; row++) {
     const VTermLineInfo *info = vterm_state_get_lineinfo(screen->state, row);
@@ -277,17 +1110,15 @@ static int erase_internal(VTermRect rect, int selective, void *user)
     for(int col = rect.start_col; col < rect.end_col; col++) {
       ScreenCell *cell = getcell(screen, row, col);
 
-      if(selective && cell->pen.protected_cell)
+      if(selective && cell->protected_cell)
         continue;
 
-      cell->chars[0] = 0;
-      cell->pen = (ScreenPen){
-        /* Only copy .fg and .bg; leave things like rv in reset state */
-        .fg = screen->pen.fg,
-        .bg = screen->pen.bg,
+      *cell = (ScreenCell){
+        .ch  = 0,
+        .pen = pen,
+        .dwl = info->doublewidth,
+        .dhl = info->doubleheight,
       };
-      cell->pen.dwl = info->doublewidth;
-      cell->pen.dhl = info->doubleheight;
     }
   }
 
@@ -303,16 +1134,30 @@ static int erase_user(VTermRect rect, int selective, void *user)
   return 1;
 }
 
-static int erase(VTermRect rect, int selective, void *user)
+INTERNAL int vterm_screen_erase(VTermRect rect, int selective, void *user)
 {
   erase_internal(rect, selective, user);
   return erase_user(rect, 0, user);
 }
 
-static int scrollrect(VTermRect rect, int downward, int rightward, void *user)
+INTERNAL int vterm_screen_scrollrect(VTermRect rect, int downward, int rightward, void *user)
 {
   VTermScreen *screen = user;
 
+  /* The damage reported for a scroll may be deferred, or left to a moverect
+   * callback, but the whole area has changed for anyone polling */
+  dirty_rect(screen, rect);
+
+  /* A held update reports the scrolled area as damage once it ends */
+  if(screen->sync.active) {
+    vterm_scroll_rect(rect, downward, rightward,
+        moverect_internal, erase_internal, screen);
+
+    damagerect(screen, rect);
+
+    return 1;
+  }
+
   if(screen->damage_merge != VTERM_DAMAGE_SCROLL) {
     vterm_scroll_rect(rect, downward, rightward,
         moverect_internal, erase_internal, screen);
@@ -393,20 +1238,69 @@ static int scrollrect(VTermRect rect, int downward, int rightward, void *user)
   return 1;
 }
 
-static int movecursor(VTermPos pos, VTermPos oldpos, int visible, void *user)
+INTERNAL int vterm_screen_movecursor(VTermPos pos, VTermPos oldpos, int visible, void *user)
 {
   VTermScreen *screen = user;
 
+  if(screen->sync.active) {
+    if(!screen->sync.cursor_moved)
+      screen->sync.cursor_oldpos = oldpos;
+    screen->sync.cursor_moved   = true;
+    screen->sync.cursor_pos     = pos;
+    screen->sync.cursor_visible = visible;
+    return 1;
+  }
+
   if(screen->callbacks && screen->callbacks->movecursor)
     return (*screen->callbacks->movecursor)(pos, oldpos, visible, screen->cbdata);
 
   return 0;
 }
 
-static int setpenattr(VTermAttr attr, VTermValue *val, void *user)
+static void sync_begin(VTermScreen *screen)
+{
+  /* Whatever came before the update is delivered as normal */
+  vterm_screen_flush_damage(screen);
+
+  screen->sync.active = true;
+  screen->sync.damaged.start_row = -1;
+  screen->sync.cursor_moved = false;
+  screen->sync.elapsed = 0;
+}
+
+static void sync_end(VTermScreen *screen)
+{
+  screen->sync.active = false;
+
+  if(screen->sync.damaged.start_row != -1) {
+    VTermRect rect = screen->sync.damaged;
+    screen->sync.damaged.start_row = -1;
+
+    /* The screen may have shrunk since */
+    rect_clip(&rect, &(VTermRect){
+        .start_row = 0, .end_row = screen->rows,
+        .start_col = 0, .end_col = screen->cols });
+
+    if(rect.end_row > rect.start_row && rect.end_col > rect.start_col)
+      merge_damage(screen, rect);
+  }
+
+  vterm_screen_flush_damage(screen);
+
+  if(screen->sync.cursor_moved) {
+    screen->sync.cursor_moved = false;
+    if(screen->callbacks && screen->callbacks->movecursor)
+      (*screen->callbacks->movecursor)(screen->sync.cursor_pos, screen->sync.cursor_oldpos,
+          screen->sync.cursor_visible, screen->cbdata);
+  }
+}
+
+INTERNAL int vterm_screen_setpenattr(VTermAttr attr, VTermValue *val, void *user)
 {
   VTermScreen *screen = user;
 
+  screen->pen_index = -1;
+
   switch(attr) {
   case VTERM_ATTR_BOLD:
     screen->pen.bold = val->boolean;
@@ -434,9 +1328,11 @@ static int setpenattr(VTermAttr attr, VTermValue *val, void *user)
     return 1;
   case VTERM_ATTR_FOREGROUND:
     screen->pen.fg = val->color;
+    screen->erase_pen_index = -1;
     return 1;
   case VTERM_ATTR_BACKGROUND:
     screen->pen.bg = val->color;
+    screen->erase_pen_index = -1;
     return 1;
   case VTERM_ATTR_SMALL:
     screen->pen.small = val->boolean;
@@ -452,6 +1348,34 @@ static int setpenattr(VTermAttr attr, VTermValue *val, void *user)
   return 0;
 }
 
+INTERNAL int vterm_screen_setpen(const VTermPen *pen, void *user)
+{
+  VTermScreen *screen = user;
+
+  screen->pen_index = -1;
+
+  if(!vterm_color_is_equal(&screen->pen.fg, &pen->fg) ||
+     !vterm_color_is_equal(&screen->pen.bg, &pen->bg))
+    screen->erase_pen_index = -1;
+
+  screen->pen = (ScreenPen){
+    .fg        = pen->fg,
+    .bg        = pen->bg,
+    .bold      = pen->bold,
+    .underline = pen->underline,
+    .italic    = pen->italic,
+    .blink     = pen->blink,
+    .reverse   = pen->reverse,
+    .conceal   = pen->conceal,
+    .strike    = pen->strike,
+    .font      = pen->font,
+    .small     = pen->small,
+    .baseline  = pen->baseline,
+  };
+
+  return 1;
+}
+
 static int settermprop(VTermProp prop, VTermValue *val, void *user)
 {
   VTermScreen *screen = user;
@@ -472,6 +1396,16 @@ static int settermprop(VTermProp prop, VTermValue *val, void *user)
     screen->global_reverse = val->boolean;
     damagescreen(screen);
     break;
+  case VTERM_PROP_SYNCOUTPUT:
+    if(val->boolean && !screen->sync.active)
+      sync_begin(screen);
+    else if(!val->boolean && screen->sync.active)
+      sync_end(screen);
+    /* The screen implements the mode itself, whether or not the host knows
+     * of it */
+    if(screen->callbacks && screen->callbacks->settermprop)
+      (*screen->callbacks->settermprop)(prop, val, screen->cbdata);
+    return 1;
   default:
     ; /* ignore */
   }
@@ -494,10 +1428,10 @@ static int bell(void *user)
 
 /* How many cells are non-blank
  * Returns the position of the first blank cell in the trailing blank end */
-static int line_popcount(ScreenCell *buffer, int row, int rows, int cols)
+static int line_popcount(ScreenCell **buffer, int row, int rows, int cols)
 {
   int col = cols - 1;
-  while(col >= 0 && buffer[row * cols + col].chars[0] == 0)
+  while(col >= 0 && buffer[row][col].ch == 0)
     col--;
   return col + 1;
 }
@@ -509,10 +1443,12 @@ static void resize_buffer(VTermScreen *screen, int bufidx, int new_rows, int new
   int old_rows = screen->rows;
   int old_cols = screen->cols;
 
-  ScreenCell *old_buffer = screen->buffers[bufidx];
+  unsigned int pen = current_pen(screen);
+
+  ScreenCell **old_buffer = screen->buffers[bufidx];
   VTermLineInfo *old_lineinfo = statefields->lineinfos[bufidx];
 
-  ScreenCell *new_buffer = vterm_allocator_malloc(screen->vt, sizeof(ScreenCell) * new_rows * new_cols);
+  ScreenCell **new_buffer = alloc_buffer(screen, new_rows, new_cols);
   VTermLineInfo *new_lineinfo = vterm_allocator_malloc(screen->vt, sizeof(new_lineinfo[0]) * new_rows);
 
   int old_row = old_rows - 1;
@@ -577,8 +1513,8 @@ static void resize_buffer(VTermScreen *screen, int bufidx, int new_rows, int new
       fprintf(stderr, "  scroll %d rows +%d downwards\n", rowcount, downwards);
 #endif
 
-      memmove(&new_buffer[downwards * new_cols], &new_buffer[0],   rowcount * new_cols * sizeof(ScreenCell));
-      memmove(&new_lineinfo[downwards],          &new_lineinfo[0], rowcount            * sizeof(new_lineinfo[0]));
+      rotate_rows(new_buffer, 0, new_rows, -downwards);
+      memmove(&new_lineinfo[downwards], &new_lineinfo[0], rowcount * sizeof(new_lineinfo[0]));
 
       new_row += downwards;
       new_row_start += downwards;
@@ -613,7 +1549,7 @@ static void resize_buffer(VTermScreen *screen, int bufidx, int new_rows, int new
 
       while(count) {
         /* TODO: This could surely be done a lot faster by memcpy()'ing the entire range */
-        new_buffer[new_row * new_cols + new_col] = old_buffer[old_row * old_cols + old_col];
+        new_buffer[new_row][new_col] = old_buffer[old_row][old_col];
 
         if(old_cursor.row == old_row && old_cursor.col == old_col)
           new_cursor.row = new_row, new_cursor.col = new_col;
@@ -640,7 +1576,7 @@ static void resize_buffer(VTermScreen *screen, int bufidx, int new_rows, int new
       }
 
       while(new_col < new_cols) {
-        clearcell(screen, &new_buffer[new_row * new_cols + new_col]);
+        clearcell(&new_buffer[new_row][new_col], pen);
         new_col++;
       }
 
@@ -667,49 +1603,50 @@ static void resize_buffer(VTermScreen *screen, int bufidx, int new_rows, int new
 
   if(old_row >= 0 && bufidx == BUFIDX_PRIMARY) {
     /* Push spare lines to scrollback buffer */
-    if(screen->callbacks && screen->callbacks->sb_pushline)
+    if(sb_enabled(screen))
       for(int row = 0; row <= old_row; row++)
         sb_pushline_from_row(screen, row);
     if(active)
       statefields->pos.row -= (old_row + 1);
   }
-  if(new_row >= 0 && bufidx == BUFIDX_PRIMARY &&
-      screen->callbacks && screen->callbacks->sb_popline) {
+  if(new_row >= 0 && bufidx == BUFIDX_PRIMARY) {
     /* Try to backfill rows by popping scrollback buffer */
     while(new_row >= 0) {
-      if(!(screen->callbacks->sb_popline(old_cols, screen->sb_buffer, screen->cbdata)))
+      if(!sb_popline(screen, old_cols, screen->sb_buffer))
         break;
 
       VTermPos pos = { .row = new_row };
       for(pos.col = 0; pos.col < old_cols && pos.col < new_cols; pos.col += screen->sb_buffer[pos.col].width) {
         VTermScreenCell *src = &screen->sb_buffer[pos.col];
-        ScreenCell *dst = &new_buffer[pos.row * new_cols + pos.col];
-
-        for(int i = 0; i < VTERM_MAX_CHARS_PER_CELL; i++) {
-          dst->chars[i] = src->chars[i];
-          if(!src->chars[i])
-            break;
-        }
-
-        dst->pen.bold      = src->attrs.bold;
-        dst->pen.underline = src->attrs.underline;
-        dst->pen.italic    = src->attrs.italic;
-        dst->pen.blink     = src->attrs.blink;
-        dst->pen.reverse   = src->attrs.reverse ^ screen->global_reverse;
-        dst->pen.conceal   = src->attrs.conceal;
-        dst->pen.strike    = src->attrs.strike;
-        dst->pen.font      = src->attrs.font;
-        dst->pen.small     = src->attrs.small;
-        dst->pen.baseline  = src->attrs.baseline;
-
-        dst->pen.fg = src->fg;
-        dst->pen.bg = src->bg;
+        ScreenCell *dst = &new_buffer[pos.row][pos.col];
+
+        ScreenPen srcpen = {
+          .bold      = src->attrs.bold,
+          .underline = src->attrs.underline,
+          .italic    = src->attrs.italic,
+          .blink     = src->attrs.blink,
+          .reverse   = src->attrs.reverse ^ screen->global_reverse,
+          .conceal   = src->attrs.conceal,
+          .strike    = src->attrs.strike,
+          .font      = src->attrs.font,
+          .small     = src->attrs.small,
+          .baseline  = src->attrs.baseline,
+
+          .fg = src->fg,
+          .bg = src->bg,
+        };
+
+        /* new_buffer isn't reachable by the collector yet, so just grow */
+        *dst = (ScreenCell){
+          .ch  = intern_chars(screen, src->chars, false),
+          .pen = intern_pen(screen, &srcpen, false),
+        };
 
         if(src->width == 2 && pos.col < (new_cols-1))
-          (dst + 1)->chars[0] = (uint32_t) -1;
+          (dst + 1)->ch = (uint32_t) -1;
       }
       for( ; pos.col < new_cols; pos.col++)
-        clearcell(screen, &new_buffer[pos.row * new_cols + pos.col]);
+        clearcell(&new_buffer[pos.row][pos.col], pen);
       new_row--;
 
       if(active)
@@ -719,14 +1656,14 @@ static void resize_buffer(VTermScreen *screen, int bufidx, int new_rows, int new
   if(new_row >= 0) {
     /* Scroll new rows back up to the top and fill in blanks at the bottom */
     int moverows = new_rows - new_row - 1;
-    memmove(&new_buffer[0], &new_buffer[(new_row + 1) * new_cols], moverows * new_cols * sizeof(ScreenCell));
+    rotate_rows(new_buffer, 0, new_rows, new_row + 1);
     memmove(&new_lineinfo[0], &new_lineinfo[new_row + 1], moverows * sizeof(new_lineinfo[0]));
 
     new_cursor.row -= (new_row + 1);
 
     for(new_row = moverows; new_row < new_rows; new_row++) {
       for(int col = 0; col < new_cols; col++)
-        clearcell(screen, &new_buffer[new_row * new_cols + col]);
+        clearcell(&new_buffer[new_row][col], pen);
       new_lineinfo[new_row] = (VTermLineInfo){ 0 };
     }
   }
@@ -780,6 +1717,9 @@ static int resize(int new_rows, int new_cols, VTermStateFields *fields, void *us
   screen->rows = new_rows;
   screen->cols = new_cols;
 
+  vterm_allocator_free(screen->vt, screen->dirty);
+  screen->dirty = alloc_dirty(screen, new_rows);
+
   if(new_cols <= old_cols) {
     if(screen->sb_buffer)
       vterm_allocator_free(screen->vt, screen->sb_buffer);
@@ -804,8 +1744,8 @@ static int setlineinfo(int row, const VTermLineInfo *newinfo, const VTermLineInf
      newinfo->doubleheight != oldinfo->doubleheight) {
     for(int col = 0; col < screen->cols; col++) {
       ScreenCell *cell = getcell(screen, row, col);
-      cell->pen.dwl = newinfo->doublewidth;
-      cell->pen.dhl = newinfo->doubleheight;
+      cell->dwl = newinfo->doublewidth;
+      cell->dhl = newinfo->doubleheight;
     }
 
     VTermRect rect = {
@@ -830,6 +1770,12 @@ static int setlineinfo(int row, const VTermLineInfo *newinfo, const VTermLineInf
 static int sb_clear(void *user) {
   VTermScreen *screen = user;
 
+  if(screen->sb_store) {
+    while(screen->sb_store->count)
+      sb_store_drop_oldest(screen);
+    return 1;
+  }
+
   if(screen->callbacks && screen->callbacks->sb_clear)
     if((*screen->callbacks->sb_clear)(screen->cbdata))
       return 1;
@@ -837,17 +1783,21 @@ static int sb_clear(void *user) {
   return 0;
 }
 
-static VTermStateCallbacks state_cbs = {
-  .putglyph    = &putglyph,
-  .movecursor  = &movecursor,
-  .scrollrect  = &scrollrect,
-  .erase       = &erase,
-  .setpenattr  = &setpenattr,
+/* State calls the hottest of these directly while they are attached; see
+ * vterm_state_set_callbacks() */
+INTERNAL const VTermStateCallbacks vterm_screen_state_callbacks = {
+  .putglyph    = &vterm_screen_putglyph,
+  .movecursor  = &vterm_screen_movecursor,
+  .scrollrect  = &vterm_screen_scrollrect,
+  .erase       = &vterm_screen_erase,
+  .setpenattr  = &vterm_screen_setpenattr,
   .settermprop = &settermprop,
   .bell        = &bell,
   .resize      = &resize,
   .setlineinfo = &setlineinfo,
   .sb_clear    = &sb_clear,
+  .putglyphs   = &vterm_screen_putglyphs,
+  .setpen      = &vterm_screen_setpen,
 };
 
 static VTermScreen *screen_new(VTerm *vt)
@@ -867,6 +1817,12 @@ static VTermScreen *screen_new(VTerm *vt)
   screen->damage_merge = VTERM_DAMAGE_CELL;
   screen->damaged.start_row = -1;
   screen->pending_scrollrect.start_row = -1;
+  screen->damage_region_count = 0;
+
+  screen->sync.active = false;
+  screen->sync.damaged.start_row = -1;
+  screen->sync.cursor_moved = false;
+  screen->sync.timeout = 1000;
 
   screen->rows = rows;
   screen->cols = cols;
@@ -877,13 +1833,29 @@ static VTermScreen *screen_new(VTerm *vt)
   screen->callbacks = NULL;
   screen->cbdata    = NULL;
 
+  screen->pens_size = 16;
+  screen->pens = vterm_allocator_malloc(vt, sizeof(ScreenPen) * screen->pens_size);
+  screen->pen_hash = vterm_allocator_malloc(vt, sizeof(int) * screen->pens_size * 2);
+  screen->pens_used = 0;
+  rehash_pens(screen);
+
+  screen->combined = NULL;
+  screen->combined_used = screen->combined_size = 0;
+
+  screen->pen_index = -1;
+  screen->erase_pen_index = -1;
+
   screen->buffers[BUFIDX_PRIMARY] = alloc_buffer(screen, rows, cols);
 
   screen->buffer = screen->buffers[BUFIDX_PRIMARY];
 
   screen->sb_buffer = vterm_allocator_malloc(screen->vt, sizeof(VTermScreenCell) * cols);
 
-  vterm_state_set_callbacks(screen->state, &state_cbs, screen);
+  screen->generation   = 0;
+  screen->dirty_polled = 0;
+  screen->dirty        = alloc_dirty(screen, rows);
+
+  vterm_state_set_callbacks(screen->state, &vterm_screen_state_callbacks, screen);
 
   return screen;
 }
@@ -895,6 +1867,16 @@ INTERNAL void vterm_screen_free(VTermScreen *screen)
     vterm_allocator_free(screen->vt, screen->buffers[BUFIDX_ALTSCREEN]);
 
   vterm_allocator_free(screen->vt, screen->sb_buffer);
+  if(screen->sb_row)
+    vterm_allocator_free(screen->vt, screen->sb_row);
+  vterm_allocator_free(screen->vt, screen->dirty);
+
+  vterm_screen_enable_scrollback(screen, 0);
+
+  vterm_allocator_free(screen->vt, screen->pens);
+  vterm_allocator_free(screen->vt, screen->pen_hash);
+  if(screen->combined)
+    vterm_allocator_free(screen->vt, screen->combined);
 
   vterm_allocator_free(screen->vt, screen);
 }
@@ -903,6 +1885,7 @@ void vterm_screen_reset(VTermScreen *screen, int hard)
 {
   screen->damaged.start_row = -1;
   screen->pending_scrollrect.start_row = -1;
+  screen->damage_region_count = 0;
   vterm_state_reset(screen->state, hard);
   vterm_screen_flush_damage(screen);
 }
@@ -931,10 +1914,10 @@ static size_t _get_chars(const VTermScreen *screen, const int utf8, void *buffer
     for(int col = rect.start_col; col < rect.end_col; col++) {
       ScreenCell *cell = getcell(screen, row, col);
 
-      if(cell->chars[0] == 0)
+      if(cell->ch == 0)
         // Erased cell, might need a space
         padding++;
-      else if(cell->chars[0] == (uint32_t)-1)
+      else if(cell->ch == (uint32_t)-1)
         // Gap behind a double-width char, do nothing
         ;
       else {
@@ -942,8 +1925,11 @@ static size_t _get_chars(const VTermScreen *screen, const int utf8, void *buffer
           PUT(UNICODE_SPACE);
           padding--;
         }
-        for(int i = 0; i < VTERM_MAX_CHARS_PER_CELL && cell->chars[i]; i++) {
-          PUT(cell->chars[i]);
+
+        uint32_t chars[VTERM_MAX_CHARS_PER_CELL];
+        cell_get_chars(screen, cell, chars);
+        for(int i = 0; i < VTERM_MAX_CHARS_PER_CELL && chars[i]; i++) {
+          PUT(chars[i]);
         }
       }
     }
@@ -974,31 +1960,29 @@ int vterm_screen_get_cell(const VTermScreen *screen, VTermPos pos, VTermScreenCe
   if(!intcell)
     return 0;
 
-  for(int i = 0; i < VTERM_MAX_CHARS_PER_CELL; i++) {
-    cell->chars[i] = intcell->chars[i];
-    if(!intcell->chars[i])
-      break;
-  }
+  const ScreenPen *pen = &screen->pens[intcell->pen];
 
-  cell->attrs.bold      = intcell->pen.bold;
-  cell->attrs.underline = intcell->pen.underline;
-  cell->attrs.italic    = intcell->pen.italic;
-  cell->attrs.blink     = intcell->pen.blink;
-  cell->attrs.reverse   = intcell->pen.reverse ^ screen->global_reverse;
-  cell->attrs.conceal   = intcell->pen.conceal;
-  cell->attrs.strike    = intcell->pen.strike;
-  cell->attrs.font      = intcell->pen.font;
-  cell->attrs.small     = intcell->pen.small;
-  cell->attrs.baseline  = intcell->pen.baseline;
+  cell_get_chars(screen, intcell, cell->chars);
 
-  cell->attrs.dwl = intcell->pen.dwl;
-  cell->attrs.dhl = intcell->pen.dhl;
+  cell->attrs.bold      = pen->bold;
+  cell->attrs.underline = pen->underline;
+  cell->attrs.italic    = pen->italic;
+  cell->attrs.blink     = pen->blink;
+  cell->attrs.reverse   = pen->reverse ^ screen->global_reverse;
+  cell->attrs.conceal   = pen->conceal;
+  cell->attrs.strike    = pen->strike;
+  cell->attrs.font      = pen->font;
+  cell->attrs.small     = pen->small;
+  cell->attrs.baseline  = pen->baseline;
 
-  cell->fg = intcell->pen.fg;
-  cell->bg = intcell->pen.bg;
+  cell->attrs.dwl = intcell->dwl;
+  cell->attrs.dhl = intcell->dhl;
+
+  cell->fg = pen->fg;
+  cell->bg = pen->bg;
 
   if(pos.col < (screen->cols - 1) &&
-     getcell(screen, pos.row, pos.col + 1)->chars[0] == (uint32_t)-1)
+     getcell(screen, pos.row, pos.col + 1)->ch == (uint32_t)-1)
     cell->width = 2;
   else
     cell->width = 1;
@@ -1011,7 +1995,7 @@ int vterm_screen_is_eol(const VTermScreen *screen, VTermPos pos)
   /* This cell is EOL if this and every cell to the right is black */
   for(; pos.col < screen->cols; pos.col++) {
     ScreenCell *cell = getcell(screen, pos.row, pos.col);
-    if(cell->chars[0] != 0)
+    if(cell->ch != 0)
       return 0;
   }
 
@@ -1086,6 +2070,25 @@ void vterm_screen_flush_damage(VTermScreen *screen)
 
     screen->damaged.start_row = -1;
   }
+
+  if(screen->damage_region_count)
+    damage_region_flush(screen);
+}
+
+void vterm_screen_set_sync_timeout(VTermScreen *screen, int msec)
+{
+  screen->sync.timeout = msec;
+}
+
+void vterm_screen_advance_time(VTermScreen *screen, int msec)
+{
+  if(!screen->sync.active || !screen->sync.timeout)
+    return;
+
+  if(msec >= screen->sync.timeout - screen->sync.elapsed)
+    sync_end(screen);
+  else
+    screen->sync.elapsed += msec;
 }
 
 void vterm_screen_set_damage_merge(VTermScreen *screen, VTermDamageSize size)
@@ -1094,31 +2097,67 @@ void vterm_screen_set_damage_merge(VTermScreen *screen, VTermDamageSize size)
   screen->damage_merge = size;
 }
 
-static int attrs_differ(VTermAttrMask attrs, ScreenCell *a, ScreenCell *b)
+uint64_t vterm_screen_get_generation(const VTermScreen *screen)
+{
+  return screen->generation;
+}
+
+int vterm_screen_get_dirty_rows(VTermScreen *screen, uint64_t since_gen, VTermDirtyRow rows[], int maxrows)
 {
-  if((attrs & VTERM_ATTR_BOLD_MASK)       && (a->pen.bold != b->pen.bold))
+  int count = 0;
+
+  for(int row = 0; row < screen->rows; row++) {
+    const ScreenRowDirty *dirty = &screen->dirty[row];
+    if(dirty->gen <= since_gen)
+      continue;
+
+    if(count < maxrows) {
+      bool span_known = since_gen >= dirty->span_from;
+      rows[count] = (VTermDirtyRow){
+        .row       = row,
+        .start_col = span_known ? dirty->start_col : 0,
+        .end_col   = span_known ? dirty->end_col   : screen->cols,
+      };
+    }
+    count++;
+  }
+
+  screen->dirty_polled = screen->generation;
+
+  return count;
+}
+
+static int attrs_differ(const VTermScreen *screen, VTermAttrMask attrs, ScreenCell *acell, ScreenCell *bcell)
+{
+  if(acell->pen == bcell->pen)
+    return 0;
+
+  const ScreenPen *a = &screen->pens[acell->pen];
+  const ScreenPen *b = &screen->pens[bcell->pen];
+
+  if((attrs & VTERM_ATTR_BOLD_MASK)       && (a->bold != b->bold))
     return 1;
-  if((attrs & VTERM_ATTR_UNDERLINE_MASK)  && (a->pen.underline != b->pen.underline))
+  if((attrs & VTERM_ATTR_UNDERLINE_MASK)  && (a->underline != b->underline))
     return 1;
-  if((attrs & VTERM_ATTR_ITALIC_MASK)     && (a->pen.italic != b->pen.italic))
+  if((attrs & VTERM_ATTR_ITALIC_MASK)     && (a->italic != b->italic))
     return 1;
-  if((attrs & VTERM_ATTR_BLINK_MASK)      && (a->pen.blink != b->pen.blink))
+  if((attrs & VTERM_ATTR_BLINK_MASK)      && (a->blink != b->blink))
     return 1;
-  if((attrs & VTERM_ATTR_REVERSE_MASK)    && (a->pen.reverse != b->pen.reverse))
+  if((attrs & VTERM_ATTR_REVERSE_MASK)    && (a->reverse != b->reverse))
     return 1;
-  if((attrs & VTERM_ATTR_CONCEAL_MASK)    && (a->pen.conceal != b->pen.conceal))
+  if((attrs & VTERM_ATTR_CONCEAL_MASK)    && (a->conceal != b->conceal))
     return 1;
-  if((attrs & VTERM_ATTR_STRIKE_MASK)     && (a->pen.strike != b->pen.strike))
+  if((attrs & VTERM_ATTR_STRIKE_MASK)     && (a->strike != b->strike))
     return 1;
-  if((attrs & VTERM_ATTR_FONT_MASK)       && (a->pen.font != b->pen.font))
+  if((attrs & VTERM_ATTR_FONT_MASK)       && (a->font != b->font))
     return 1;
-  if((attrs & VTERM_ATTR_FOREGROUND_MASK) && !vterm_color_is_equal(&a->pen.fg, &b->pen.fg))
+  if((attrs & VTERM_ATTR_FOREGROUND_MASK) && !vterm_color_is_equal(&a->fg, &b->fg))
     return 1;
-  if((attrs & VTERM_ATTR_BACKGROUND_MASK) && !vterm_color_is_equal(&a->pen.bg, &b->pen.bg))
+  if((attrs & VTERM_ATTR_BACKGROUND_MASK) && !vterm_color_is_equal(&a->bg, &b->bg))
     return 1;
-  if((attrs & VTERM_ATTR_SMALL_MASK)    && (a->pen.small != b->pen.small))
+  if((attrs & VTERM_ATTR_SMALL_MASK)    && (a->small != b->small))
     return 1;
-  if((attrs & VTERM_ATTR_BASELINE_MASK)    && (a->pen.baseline != b->pen.baseline))
+  if((attrs & VTERM_ATTR_BASELINE_MASK)    && (a->baseline != b->baseline))
     return 1;
 
   return 0;
@@ -1140,12 +2179,12 @@ int vterm_screen_get_attrs_extent(const VTermScreen *screen, VTermRect *extent,
   int col;
 
   for(col = pos.col - 1; col >= extent->start_col; col--)
-    if(attrs_differ(attrs, target, getcell(screen, pos.row, col)))
+    if(attrs_differ(screen, attrs, target, getcell(screen, pos.row, col)))
       break;
   extent->start_col = col + 1;
 
   for(col = pos.col + 1; col < extent->end_col; col++)
-    if(attrs_differ(attrs, target, getcell(screen, pos.row, col)))
+    if(attrs_differ(screen, attrs, target, getcell(screen, pos.row, col)))
       break;
   extent->end_col = col - 1;
 
@@ -1157,16 +2196,21 @@ void vterm_screen_convert_color_to_rgb(const VTermScreen *screen, VTermColor *co
   vterm_state_convert_color_to_rgb(screen->state, col);
 }
 
-static void reset_default_colours(VTermScreen *screen, ScreenCell *buffer)
+static void reset_default_colours(VTermScreen *screen)
 {
-  for(int row = 0; row <= screen->rows - 1; row++)
-    for(int col = 0; col <= screen->cols - 1; col++) {
-      ScreenCell *cell = &buffer[row * screen->cols + col];
-      if(VTERM_COLOR_IS_DEFAULT_FG(&cell->pen.fg))
-        cell->pen.fg = screen->pen.fg;
-      if(VTERM_COLOR_IS_DEFAULT_BG(&cell->pen.bg))
-        cell->pen.bg = screen->pen.bg;
-    }
+  /* Every cell refers to a pen in the table, so update those in place */
+  for(int i = 0; i < screen->pens_used; i++) {
+    ScreenPen *pen = &screen->pens[i];
+    if(VTERM_COLOR_IS_DEFAULT_FG(&pen->fg))
+      pen->fg = screen->pen.fg;
+    if(VTERM_COLOR_IS_DEFAULT_BG(&pen->bg))
+      pen->bg = screen->pen.bg;
+  }
+
+  rehash_pens(screen);
+
+  screen->pen_index = -1;
+  screen->erase_pen_index = -1;
 }
 
 void vterm_screen_set_default_colors(VTermScreen *screen, const VTermColor *default_fg, const VTermColor *default_bg)
@@ -1185,7 +2229,180 @@ void vterm_screen_set_default_colors(VTermScreen *screen, const VTermColor *defa
                         | VTERM_COLOR_DEFAULT_BG;
   }
 
-  reset_default_colours(screen, screen->buffers[0]);
-  if(screen->buffers[1])
-    reset_default_colours(screen, screen->buffers[1]);
+  reset_default_colours(screen);
+}
+
+void vterm_screen_enable_scrollback(VTermScreen *screen, size_t max_bytes)
+{
+  struct ScreenScrollback *sb = screen->sb_store;
+
+  if(!max_bytes) {
+    if(!sb)
+      return;
+
+    while(sb->count)
+      sb_store_drop_oldest(screen);
+    if(sb->lines)
+      vterm_allocator_free(screen->vt, sb->lines);
+    vterm_allocator_free(screen->vt, sb);
+    screen->sb_store = NULL;
+    return;
+  }
+
+  if(!sb) {
+    sb = vterm_allocator_malloc(screen->vt, sizeof(struct ScreenScrollback));
+    *sb = (struct ScreenScrollback){ 0 };
+    screen->sb_store = sb;
+  }
+
+  sb->max_bytes = max_bytes;
+  while(sb->count && sb->bytes > sb->max_bytes)
+    sb_store_drop_oldest(screen);
+}
+
+int vterm_screen_get_scrollback_lines(const VTermScreen *screen)
+{
+  return screen->sb_store ? screen->sb_store->count : 0;
+}
+
+size_t vterm_screen_get_scrollback_bytes(const VTermScreen *screen)
+{
+  return screen->sb_store ? screen->sb_store->bytes : 0;
+}
+
+int vterm_screen_get_scrollback_cells(const VTermScreen *screen, int line, VTermScreenCell cells[], int cols)
+{
+  const VTermScreenRow *sbline = screen->sb_store ? sb_store_line(screen->sb_store, line) : NULL;
+  if(!sbline)
+    return 0;
+
+  sb_store_get_cells(screen, sbline, cells, cols);
+
+  return sbline->cols;
+}
+
+size_t vterm_screen_get_scrollback_text(const VTermScreen *screen, int line, char *str, size_t len)
+{
+  const VTermScreenRow *sbline = screen->sb_store ? sb_store_line(screen->sb_store, line) : NULL;
+  if(!sbline)
+    return 0;
+
+  const unsigned char *text = vterm_screen_row_text(sbline);
+  size_t outpos = 0;
+  int padding = 0;
+
+  /* As vterm_screen_get_text(); erased cells only become spaces when there
+   * is more text after them */
+  for(int i = 0; i < sbline->textlen; ) {
+    if(text[i] == VTERM_ROW_TEXT_ERASED) {
+      padding++;
+      i++;
+      continue;
+    }
+    if(text[i] == VTERM_ROW_TEXT_WIDE_GAP) {
+      i++;
+      continue;
+    }
+    if(text[i] == VTERM_ROW_TEXT_COMBINING)
+      i++;
+
+    for(; padding; padding--, outpos++)
+      if(str && outpos < len)
+        str[outpos] = UNICODE_SPACE;
+
+    uint32_t cp;
+    int nbytes = row_text_decode(text + i, &cp);
+    if(str && outpos + nbytes <= len)
+      memcpy(str + outpos, text + i, nbytes);
+    outpos += nbytes;
+    i += nbytes;
+  }
+
+  return outpos;
+}
+
+size_t vterm_screen_row_size(const VTermScreenRow *row)
+{
+  return sizeof(VTermScreenRow) + sizeof(VTermScreenRowRun) * row->nruns + row->textlen;
+}
+
+const VTermScreenRowRun *vterm_screen_row_runs(const VTermScreenRow *row)
+{
+  return (const VTermScreenRowRun *)(row + 1);
+}
+
+const unsigned char *vterm_screen_row_text(const VTermScreenRow *row)
+{
+  return (const unsigned char *)(vterm_screen_row_runs(row) + row->nruns);
+}
+
+void vterm_screen_row_iter_init(VTermScreenRowIter *iter, const VTermScreenRow *row)
+{
+  iter->row = row;
+  iter->run = 0;
+  iter->col = 0;
+}
+
+const VTermScreenRowRun *vterm_screen_row_iter_next(VTermScreenRowIter *iter, int *start_col, int *end_col)
+{
+  if(iter->run >= iter->row->nruns)
+    return NULL;
+
+  const VTermScreenRowRun *run = vterm_screen_row_runs(iter->row) + iter->run++;
+
+  if(start_col)
+    *start_col = iter->col;
+  iter->col += run->cells;
+  if(end_col)
+    *end_col = iter->col;
+
+  return run;
+}
+
+void vterm_screen_row_get_cells(const VTermScreenRow *row, VTermScreenCell cells[], int cols)
+{
+  const VTermScreenRowRun *run = vterm_screen_row_runs(row);
+  int run_remaining = run->cells;
+  const unsigned char *text = vterm_screen_row_text(row);
+  const unsigned char *text_end = text + row->textlen;
+
+  for(int col = 0; col < cols; col++) {
+    VTermScreenCell *cell = &cells[col];
+
+    /* Columns past the end of the row continue the last run */
+    if(!run_remaining && run < vterm_screen_row_runs(row) + row->nruns - 1)
+      run_remaining = (++run)->cells;
+    if(run_remaining)
+      run_remaining--;
+
+    for(int i = 0; i < VTERM_MAX_CHARS_PER_CELL; i++)
+      cell->chars[i] = 0;
+
+    if(text < text_end) {
+      if(*text == VTERM_ROW_TEXT_ERASED)
+        text++;
+      else if(*text == VTERM_ROW_TEXT_WIDE_GAP) {
+        cell->chars[0] = (uint32_t)-1;
+        text++;
+      }
+      else {
+        int i = 0;
+        text += row_text_decode(text, &cell->chars[i++]);
+        while(text < text_end && *text == VTERM_ROW_TEXT_COMBINING) {
+          uint32_t cp;
+          text += 1 + row_text_decode(text + 1, &cp);
+          if(i < VTERM_MAX_CHARS_PER_CELL)
+            cell->chars[i++] = cp;
+        }
+      }
+    }
+
+    cell->attrs = run->attrs;
+    cell->fg    = run->fg;
+    cell->bg    = run->bg;
+    cell->width = 1;
+
+    if(col > 0 && cell->chars[0] == (uint32_t)-1)
+      cells[col-1].width = 2;
+  }
 }
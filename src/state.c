@@ -21,13 +21,110 @@ static void putglyph(VTermState *state, const uint32_t chars[], int width, VTerm
     .dhl = state->lineinfo[pos.row].doubleheight,
   };
 
-  if(state->callbacks && state->callbacks->putglyph)
+  if(state->screen) {
+    if(vterm_screen_putglyph(&info, pos, state->screen))
+      return;
+  }
+  else if(state->callbacks && state->callbacks->putglyph)
     if((*state->callbacks->putglyph)(&info, pos, state->cbdata))
       return;
 
   DEBUG_LOG("libvterm: Unhandled putglyph U+%04x at (%d,%d)\n", chars[0], pos.col, pos.row);
 }
 
+/* on_text collects consecutive glyphs on one row into a run, to hand them all
+ * to the putglyphs callback at once when it is set
+ */
+#define GLYPH_RUN_MAX 64
+
+struct GlyphRun {
+  VTermPos       pos;
+  int            end_col;
+  int            count;
+  VTermGlyphInfo info[GLYPH_RUN_MAX];
+  uint32_t       chars[GLYPH_RUN_MAX][VTERM_MAX_CHARS_PER_CELL + 1];
+};
+
+static void putglyph_run(VTermState *state, struct GlyphRun *run)
+{
+  if(!run->count)
+    return;
+
+  if(state->screen ?
+      !vterm_screen_putglyphs(run->info, run->count, run->pos, state->screen) :
+      !(*state->callbacks->putglyphs)(run->info, run->count, run->pos, state->cbdata)) {
+    VTermPos pos = run->pos;
+    for(int i = 0; i < run->count; i++) {
+      putglyph(state, run->info[i].chars, run->info[i].width, pos);
+      pos.col += run->info[i].width;
+    }
+  }
+
+  run->count = 0;
+}
+
+static void append_glyph(VTermState *state, struct GlyphRun *run, const uint32_t chars[], int nchars, int width)
+{
+  if(run->count &&
+     (run->count == GLYPH_RUN_MAX ||
+      state->pos.row != run->pos.row || state->pos.col != run->end_col))
+    putglyph_run(state, run);
+
+  if(!run->count) {
+    run->pos     = state->pos;
+    run->end_col = state->pos.col;
+  }
+
+  memcpy(run->chars[run->count], chars, (nchars + 1) * sizeof(chars[0]));
+  run->info[run->count] = (VTermGlyphInfo){
+    .chars = run->chars[run->count],
+    .width = width,
+    .protected_cell = state->protected_cell,
+    .dwl = state->lineinfo[state->pos.row].doublewidth,
+    .dhl = state->lineinfo[state->pos.row].doubleheight,
+  };
+
+  run->count++;
+  run->end_col += width;
+}
+
+/* Puts the same glyph count times along the row from the cursor, a batch at
+ * a time through putglyphs when it is set, all sharing the one chars array
+ */
+static void putglyph_repeat(VTermState *state, const uint32_t chars[], int width, int count)
+{
+  VTermPos pos = state->pos;
+
+  if(state->callbacks && state->callbacks->putglyphs) {
+    VTermGlyphInfo info[GLYPH_RUN_MAX];
+    int n = count < GLYPH_RUN_MAX ? count : GLYPH_RUN_MAX;
+
+    for(int i = 0; i < n; i++)
+      info[i] = (VTermGlyphInfo){
+        .chars = chars,
+        .width = width,
+        .protected_cell = state->protected_cell,
+        .dwl = state->lineinfo[pos.row].doublewidth,
+        .dhl = state->lineinfo[pos.row].doubleheight,
+      };
+
+    while(count) {
+      n = count < GLYPH_RUN_MAX ? count : GLYPH_RUN_MAX;
+      if(state->screen ?
+          !vterm_screen_putglyphs(info, n, pos, state->screen) :
+          !(*state->callbacks->putglyphs)(info, n, pos, state->cbdata))
+        break;
+      pos.col += n * width;
+      count -= n;
+    }
+  }
+
+  for( ; count; count--) {
+    putglyph(state, chars, width, pos);
+    pos.col += width;
+  }
+}
+
 static void updatecursor(VTermState *state, VTermPos *oldpos, int cancel_phantom)
 {
   if(state->pos.col == oldpos->col && state->pos.row == oldpos->row)
@@ -36,7 +133,9 @@ static void updatecursor(VTermState *state, VTermPos *oldpos, int cancel_phantom
   if(cancel_phantom)
     state->at_phantom = 0;
 
-  if(state->callbacks && state->callbacks->movecursor)
+  if(state->screen)
+    vterm_screen_movecursor(state->pos, *oldpos, state->mode.cursor_visible, state->screen);
+  else if(state->callbacks && state->callbacks->movecursor)
     if((*state->callbacks->movecursor)(state->pos, *oldpos, state->mode.cursor_visible, state->cbdata))
       return;
 }
@@ -51,7 +150,9 @@ static void erase(VTermState *state, VTermRect rect, int selective)
       state->lineinfo[row].continuation = 0;
   }
 
-  if(state->callbacks && state->callbacks->erase)
+  if(state->screen)
+    vterm_screen_erase(rect, selective, state->screen);
+  else if(state->callbacks && state->callbacks->erase)
     if((*state->callbacks->erase)(rect, selective, state->cbdata))
       return;
 }
@@ -72,6 +173,7 @@ static VTermState *vterm_state_new(VTerm *vt)
   state->mouse_protocol = MOUSE_X10;
 
   state->callbacks = NULL;
+  state->screen    = NULL;
   state->cbdata    = NULL;
 
   state->selection.callbacks = NULL;
@@ -106,9 +208,163 @@ INTERNAL void vterm_state_free(VTermState *state)
   if(state->lineinfos[BUFIDX_ALTSCREEN])
     vterm_allocator_free(state->vt, state->lineinfos[BUFIDX_ALTSCREEN]);
   vterm_allocator_free(state->vt, state->combine_chars);
+  if(state->handlers.entries)
+    vterm_allocator_free(state->vt, state->handlers.entries);
   vterm_allocator_free(state->vt, state);
 }
 
+/* Registered handlers are keyed on a type byte followed by the bytes that
+ * identify the sequence: the leader, a NUL and the intermediates and final
+ * byte of a CSI, the command number of an OSC, or the command of a DCS */
+#define HANDLER_KEY_MAX (3 + 2 * CSI_LEADER_MAX)
+
+struct VTermStateHandler {
+  unsigned char keylen; /* 0 if the slot is empty */
+  char key[HANDLER_KEY_MAX];
+
+  union {
+    VTermStateCSIHandler *csi;
+    VTermStateOSCHandler *osc;
+    VTermStateDCSHandler *dcs;
+  } func;
+  void *user;
+};
+
+static size_t handler_key_csi(char key[], const char *leader, const char *intermed, char command)
+{
+  size_t leaderlen   = leader   ? strlen(leader)   : 0;
+  size_t intermedlen = intermed ? strlen(intermed) : 0;
+
+  if(3 + leaderlen + intermedlen > HANDLER_KEY_MAX)
+    return 0;
+
+  size_t len = 0;
+  key[len++] = 'C';
+  if(leaderlen)
+    memcpy(key + len, leader, leaderlen);
+  len += leaderlen;
+  key[len++] = 0;
+  if(intermedlen)
+    memcpy(key + len, intermed, intermedlen);
+  len += intermedlen;
+  key[len++] = command;
+
+  return len;
+}
+
+static size_t handler_key_osc(char key[], int command)
+{
+  key[0] = 'O';
+  memcpy(key + 1, &command, sizeof(command));
+  return 1 + sizeof(command);
+}
+
+static size_t handler_key_dcs(char key[], const char *command, size_t commandlen)
+{
+  if(1 + commandlen > HANDLER_KEY_MAX)
+    return 0;
+
+  key[0] = 'D';
+  memcpy(key + 1, command, commandlen);
+  return 1 + commandlen;
+}
+
+static size_t handler_hash(const char key[], size_t keylen)
+{
+  uint32_t hash = 2166136261u;
+  for(size_t i = 0; i < keylen; i++)
+    hash = (hash ^ (unsigned char)key[i]) * 16777619u;
+  return hash;
+}
+
+/* Returns the slot holding the key, or the empty one it would go in */
+static struct VTermStateHandler *handler_slot(struct VTermStateHandler *entries, size_t size, const char key[], size_t keylen)
+{
+  size_t i = handler_hash(key, keylen) & (size - 1);
+
+  while(entries[i].keylen &&
+      (entries[i].keylen != keylen || memcmp(entries[i].key, key, keylen) != 0))
+    i = (i + 1) & (size - 1);
+
+  return &entries[i];
+}
+
+static const struct VTermStateHandler *handler_lookup(VTermState *state, const char key[], size_t keylen)
+{
+  if(!keylen)
+    return NULL;
+
+  struct VTermStateHandler *entry = handler_slot(state->handlers.entries, state->handlers.size, key, keylen);
+  return entry->keylen ? entry : NULL;
+}
+
+static int handler_grow(VTermState *state)
+{
+  size_t newsize = state->handlers.size ? state->handlers.size * 2 : 16;
+  struct VTermStateHandler *newentries = vterm_allocator_malloc(state->vt, newsize * sizeof(newentries[0]));
+  if(!newentries)
+    return 0;
+
+  memset(newentries, 0, newsize * sizeof(newentries[0]));
+
+  for(size_t i = 0; i < state->handlers.size; i++) {
+    struct VTermStateHandler *entry = &state->handlers.entries[i];
+    if(entry->keylen)
+      *handler_slot(newentries, newsize, entry->key, entry->keylen) = *entry;
+  }
+
+  if(state->handlers.entries)
+    vterm_allocator_free(state->vt, state->handlers.entries);
+
+  state->handlers.entries = newentries;
+  state->handlers.size    = newsize;
+  return 1;
+}
+
+static int handler_set(VTermState *state, const char key[], size_t keylen, struct VTermStateHandler *handler)
+{
+  if(!keylen)
+    return 0;
+
+  if(!handler) {
+    if(!state->handlers.count)
+      return 1;
+
+    size_t size = state->handlers.size;
+    struct VTermStateHandler *entries = state->handlers.entries;
+    struct VTermStateHandler *entry = handler_slot(entries, size, key, keylen);
+    if(!entry->keylen)
+      return 1;
+
+    entry->keylen = 0;
+    state->handlers.count--;
+
+    /* Put back the rest of the run of used slots after it, as a lookup
+     * would otherwise stop at the gap left behind */
+    for(size_t i = (entry - entries + 1) & (size - 1); entries[i].keylen; i = (i + 1) & (size - 1)) {
+      struct VTermStateHandler moved = entries[i];
+      entries[i].keylen = 0;
+      *handler_slot(entries, size, moved.key, moved.keylen) = moved;
+    }
+
+    return 1;
+  }
+
+  /* Keep the table at most three-quarters full */
+  if((state->handlers.count + 1) * 4 > state->handlers.size * 3)
+    if(!handler_grow(state))
+      return 0;
+
+  struct VTermStateHandler *entry = handler_slot(state->handlers.entries, state->handlers.size, key, keylen);
+  if(!entry->keylen)
+    state->handlers.count++;
+
+  *entry = *handler;
+  entry->keylen = keylen;
+  memcpy(entry->key, key, keylen);
+  return 1;
+}
+
 static void scroll(VTermState *state, VTermRect rect, int downward, int rightward)
 {
   if(!downward && !rightward)
@@ -146,6 +402,11 @@ static void scroll(VTermState *state, VTermRect rect, int downward, int rightwar
     }
   }
 
+  if(state->screen) {
+    vterm_screen_scrollrect(rect, downward, rightward, state->screen);
+    return;
+  }
+
   if(state->callbacks && state->callbacks->scrollrect)
     if((*state->callbacks->scrollrect)(rect, downward, rightward, state->cbdata))
       return;
@@ -269,6 +530,30 @@ static void set_lineinfo(VTermState *state, int row, int force, int dwl, int dhl
     state->lineinfo[row] = info;
 }
 
+/* Adds up the widths of the glyphs starting at codepoints[i], grouped as
+ * on_text groups them, for as many as fit within the given number of
+ * columns
+ */
+static int glyphs_width(const uint32_t codepoints[], int i, int npoints, int cols)
+{
+  int total = 0;
+
+  while(i < npoints && total < cols) {
+    int width = (codepoints[i] >= 0x20 && codepoints[i] < 0x7f) ? 1 : vterm_unicode_width(codepoints[i]);
+
+    int nchars = 1;
+    for(i++; i < npoints && vterm_unicode_is_combining(codepoints[i]); i++, nchars++)
+      if(nchars < VTERM_MAX_CHARS_PER_CELL)
+        width += vterm_unicode_width(codepoints[i]);
+
+    if(total + width > cols)
+      break;
+    total += width;
+  }
+
+  return total;
+}
+
 static int on_text(const char bytes[], size_t len, void *user)
 {
   VTermState *state = user;
@@ -300,6 +585,17 @@ static int on_text(const char bytes[], size_t len, void *user)
   if(state->gsingle_set && npoints)
     state->gsingle_set = 0;
 
+  struct GlyphRun run;
+  struct GlyphRun *batch = NULL;
+  if(state->callbacks && state->callbacks->putglyphs) {
+    run.count = 0;
+    batch = &run;
+  }
+
+  /* In insert mode, the columns up to here have already been opened up for
+   * the glyphs on this row */
+  int insert_end = 0;
+
   int i = 0;
 
   /* This is a combining char. that needs to be merged with the previous
@@ -348,33 +644,45 @@ static int on_text(const char bytes[], size_t len, void *user)
     // Try to find combining characters following this
     int glyph_starts = i;
     int glyph_ends;
-    for(glyph_ends = i + 1;
-        (glyph_ends < npoints) && (glyph_ends < glyph_starts + VTERM_MAX_CHARS_PER_CELL);
-        glyph_ends++)
-      if(!vterm_unicode_is_combining(codepoints[glyph_ends]))
-        break;
 
     int width = 0;
 
     uint32_t chars[VTERM_MAX_CHARS_PER_CELL + 1];
 
-    for( ; i < glyph_ends; i++) {
-      chars[i - glyph_starts] = codepoints[i];
-      int this_width = vterm_unicode_width(codepoints[i]);
+    if(codepoints[i] >= 0x20 && codepoints[i] < 0x7f &&
+       (i + 1 == npoints || codepoints[i + 1] < 0x7f)) {
+      /* Printable ASCII not followed by anything that could combine with it;
+       * by far the most common case, so skip the Unicode table lookups */
+      glyph_ends = i + 1;
+      chars[0] = codepoints[i];
+      width = 1;
+    }
+    else {
+      for(glyph_ends = i + 1;
+          (glyph_ends < npoints) && (glyph_ends < glyph_starts + VTERM_MAX_CHARS_PER_CELL);
+          glyph_ends++)
+        if(!vterm_unicode_is_combining(codepoints[glyph_ends]))
+          break;
+
+      for( ; i < glyph_ends; i++) {
+        chars[i - glyph_starts] = codepoints[i];
+        int this_width = vterm_unicode_width(codepoints[i]);
 #ifdef DEBUG
-      if(this_width < 0) {
-        fprintf(stderr, "Text with negative-width codepoint U+%04x\n", codepoints[i]);
-        abort();
-      }
+        if(this_width < 0) {
+          fprintf(stderr, "Text with negative-width codepoint U+%04x\n", codepoints[i]);
+          abort();
+        }
 #endif
-      width += this_width;
-    }
+        width += this_width;
+      }
 
-    while(i < npoints && vterm_unicode_is_combining(codepoints[i]))
-      i++;
+      while(i < npoints && vterm_unicode_is_combining(codepoints[i]))
+        i++;
+
+      i--;
+    }
 
     chars[glyph_ends - glyph_starts] = 0;
-    i--;
 
 #ifdef DEBUG_GLYPH_COMBINE
     int printpos;
@@ -384,28 +692,44 @@ static int on_text(const char bytes[], size_t len, void *user)
     printf("}, onscreen width %d\n", width);
 #endif
 
+    if(batch && (state->at_phantom || state->pos.col + width > THISROWWIDTH(state)))
+      putglyph_run(state, batch);
+
     if(state->at_phantom || state->pos.col + width > THISROWWIDTH(state)) {
       linefeed(state);
       state->pos.col = 0;
       state->at_phantom = 0;
       state->lineinfo[state->pos.row].continuation = 1;
+      insert_end = 0;
     }
 
-    if(state->mode.insert) {
-      /* TODO: This will be a little inefficient for large bodies of text, as
-       * it'll have to 'ICH' effectively before every glyph. We should scan
-       * ahead and ICH as many times as required
+    if(state->mode.insert && state->pos.col >= insert_end) {
+      /* Rather than an ICH before every glyph, scan ahead and make room for
+       * all of those that will fit on this row at once
        */
+      int cols = glyphs_width(codepoints, glyph_starts, npoints, THISROWWIDTH(state) - state->pos.col);
+
+      if(batch)
+        putglyph_run(state, batch);
+
       VTermRect rect = {
         .start_row = state->pos.row,
         .end_row   = state->pos.row + 1,
         .start_col = state->pos.col,
         .end_col   = THISROWWIDTH(state),
       };
-      scroll(state, rect, 0, -1);
+      scroll(state, rect, 0, -cols);
+
+      insert_end = state->pos.col + cols;
     }
 
-    putglyph(state, chars, width, state->pos);
+    if(batch && width > 0)
+      append_glyph(state, batch, chars, glyph_ends - glyph_starts, width);
+    else {
+      if(batch)
+        putglyph_run(state, batch);
+      putglyph(state, chars, width, state->pos);
+    }
 
     if(i == npoints - 1) {
       /* End of the buffer. Save the chars in case we have to combine with
@@ -432,6 +756,9 @@ static int on_text(const char bytes[], size_t len, void *user)
     }
   }
 
+  if(batch)
+    putglyph_run(state, batch);
+
   updatecursor(state, &oldpos, 0);
 
 #ifdef DEBUG
@@ -699,7 +1026,9 @@ static int on_escape(const char *bytes, size_t len, void *user)
   {
     VTermPos oldpos = state->pos;
     vterm_state_reset(state, 1);
-    if(state->callbacks && state->callbacks->movecursor)
+    if(state->screen)
+      vterm_screen_movecursor(state->pos, oldpos, state->mode.cursor_visible, state->screen);
+    else if(state->callbacks && state->callbacks->movecursor)
       (*state->callbacks->movecursor)(state->pos, oldpos, state->mode.cursor_visible, state->cbdata);
     return 1;
   }
@@ -834,6 +1163,10 @@ static void set_dec_mode(VTermState *state, int num, int val)
     state->mode.bracketpaste = val;
     break;
 
+  case 2026:
+    settermprop_bool(state, VTERM_PROP_SYNCOUTPUT, val);
+    break;
+
   default:
     DEBUG_LOG("libvterm: Unknown DEC mode %d\n", num);
     return;
@@ -909,6 +1242,10 @@ static void request_dec_mode(VTermState *state, int num)
       reply = state->mode.bracketpaste;
       break;
 
+    case 2026:
+      reply = state->mode.sync_output;
+      break;
+
     default:
       vterm_push_output_sprintf_ctrl(state->vt, C1_CSI, "?%d;%d$y", num, 0);
       return;
@@ -930,6 +1267,14 @@ static int on_csi(const char *leader, const long args[], int argcount, const cha
   int intermed_byte = 0;
   int cancel_phantom = 1;
 
+  if(state->handlers.count) {
+    char key[HANDLER_KEY_MAX];
+    const struct VTermStateHandler *handler =
+      handler_lookup(state, key, handler_key_csi(key, leader, intermed, command));
+    if(handler && (*handler->func.csi)(leader, args, argcount, intermed, command, handler->user))
+      return 1;
+  }
+
   if(leader && leader[0]) {
     if(leader[1]) // longer than 1 char
       return 0;
@@ -1231,19 +1576,36 @@ static int on_csi(const char *leader, const long args[], int argcount, const cha
 
   case 0x62: { // REP - ECMA-48 8.3.103
     const int row_width = THISROWWIDTH(state);
+    const int width = state->combine_width;
+    /* Without a glyph that takes up some space there is nothing to repeat */
+    if(width < 1)
+      break;
+
     count = CSI_ARG_COUNT(args[0]);
     col = state->pos.col + count;
     UBOUND(col, row_width);
-    while (state->pos.col < col) {
-      putglyph(state, state->combine_chars, state->combine_width, state->pos);
-      state->pos.col += state->combine_width;
-    }
-    if (state->pos.col + state->combine_width >= row_width) {
-      if (state->mode.autowrap) {
+
+    /* Enough glyphs to cover the columns up to col, short of any that would
+     * hang over the end of the row */
+    int glyphs = (col - state->pos.col + width - 1) / width;
+    if(glyphs > (row_width - state->pos.col) / width)
+      glyphs = (row_width - state->pos.col) / width;
+    if(glyphs < 1)
+      break;
+
+    putglyph_repeat(state, state->combine_chars, width, glyphs);
+
+    /* As for text, the cursor stays on a glyph that reaches the end of the
+     * row */
+    state->pos.col += (glyphs - 1) * width;
+    if(state->pos.col + width >= row_width) {
+      if(state->mode.autowrap) {
         state->at_phantom = 1;
         cancel_phantom = 0;
       }
     }
+    else
+      state->pos.col += width;
     break;
   }
 
@@ -1778,6 +2140,14 @@ static int on_osc(int command, VTermStringFragment frag, void *user)
 {
   VTermState *state = user;
 
+  if(state->handlers.count) {
+    char key[HANDLER_KEY_MAX];
+    const struct VTermStateHandler *handler =
+      handler_lookup(state, key, handler_key_osc(key, command));
+    if(handler && (*handler->func.osc)(command, frag, handler->user))
+      return 1;
+  }
+
   switch(command) {
     case 0:
       settermprop_string(state, VTERM_PROP_ICONNAME, frag);
@@ -1898,6 +2268,14 @@ static int on_dcs(const char *command, size_t commandlen, VTermStringFragment fr
 {
   VTermState *state = user;
 
+  if(state->handlers.count) {
+    char key[HANDLER_KEY_MAX];
+    const struct VTermStateHandler *handler =
+      handler_lookup(state, key, handler_key_dcs(key, command, commandlen));
+    if(handler && (*handler->func.dcs)(command, commandlen, frag, handler->user))
+      return 1;
+  }
+
   if(commandlen == 2 && strneq(command, "$q", 2)) {
     request_status_string(state, frag);
     return 1;
@@ -2126,6 +2504,11 @@ void vterm_state_reset(VTermState *state, int hard)
   settermprop_bool(state, VTERM_PROP_CURSORBLINK,   1);
   settermprop_int (state, VTERM_PROP_CURSORSHAPE,   VTERM_PROP_CURSORSHAPE_BLOCK);
 
+  /* Deliver any update still held back before the erase below */
+  if(state->mode.sync_output)
+    settermprop_bool(state, VTERM_PROP_SYNCOUTPUT, 0);
+  state->mode.sync_output = 0;
+
   if(hard) {
     state->pos.row = 0;
     state->pos.col = 0;
@@ -2147,12 +2530,18 @@ void vterm_state_set_callbacks(VTermState *state, const VTermStateCallbacks *cal
     state->callbacks = callbacks;
     state->cbdata = user;
 
+    /* The screen's callbacks are known, so can be called directly */
+    state->screen = (callbacks == &vterm_screen_state_callbacks) ? user : NULL;
+
     if(state->callbacks && state->callbacks->initpen)
       (*state->callbacks->initpen)(state->cbdata);
+
+    vterm_state_initpen(state);
   }
   else {
     state->callbacks = NULL;
     state->cbdata = NULL;
+    state->screen = NULL;
   }
 }
 
@@ -2178,6 +2567,27 @@ void *vterm_state_get_unrecognised_fbdata(VTermState *state)
   return state->fbdata;
 }
 
+int vterm_state_register_csi(VTermState *state, const char *leader, const char *intermed, char command, VTermStateCSIHandler *handler, void *user)
+{
+  char key[HANDLER_KEY_MAX];
+  struct VTermStateHandler entry = { .func.csi = handler, .user = user };
+  return handler_set(state, key, handler_key_csi(key, leader, intermed, command), handler ? &entry : NULL);
+}
+
+int vterm_state_register_osc(VTermState *state, int command, VTermStateOSCHandler *handler, void *user)
+{
+  char key[HANDLER_KEY_MAX];
+  struct VTermStateHandler entry = { .func.osc = handler, .user = user };
+  return handler_set(state, key, handler_key_osc(key, command), handler ? &entry : NULL);
+}
+
+int vterm_state_register_dcs(VTermState *state, const char *command, size_t commandlen, VTermStateDCSHandler *handler, void *user)
+{
+  char key[HANDLER_KEY_MAX];
+  struct VTermStateHandler entry = { .func.dcs = handler, .user = user };
+  return handler_set(state, key, handler_key_dcs(key, command, commandlen), handler ? &entry : NULL);
+}
+
 int vterm_state_set_termprop(VTermState *state, VTermProp prop, VTermValue *val)
 {
   /* Only store the new value of the property if usercode said it was happy.
@@ -2228,6 +2638,9 @@ int vterm_state_set_termprop(VTermState *state, VTermProp prop, VTermValue *val)
   case VTERM_PROP_FOCUSREPORT:
     state->mode.report_focus = val->boolean;
     return 1;
+  case VTERM_PROP_SYNCOUTPUT:
+    state->mode.sync_output = val->boolean;
+    return 1;
 
   case VTERM_N_PROPS:
     return 0;
@@ -48,6 +48,27 @@ VTerm *vterm_new_with_allocator(int rows, int cols, VTermAllocatorFunctions *fun
 /* A handy macro for defaulting values out of builder fields */
 #define DEFAULT(v, def)  ((v) ? (v) : (def))
 
+static void parser_init(VTermParser *parser, const VTermAllocatorFunctions *allocator, void *allocdata)
+{
+  parser->allocator = allocator;
+  parser->allocdata = allocdata;
+
+  parser->state = NORMAL;
+
+  parser->callbacks = NULL;
+  parser->cbdata    = NULL;
+
+  parser->emit_nul  = false;
+
+  parser->whole.max    = 0;
+  parser->whole.limit  = 0;
+  parser->whole.buffer = NULL;
+  parser->whole.size   = 0;
+
+  parser->pull      = NULL;
+  parser->csi_cache = NULL;
+}
+
 VTerm *vterm_build(const struct VTermBuilder *builder)
 {
   const VTermAllocatorFunctions *allocator = DEFAULT(builder->allocator, &default_allocator);
@@ -61,12 +82,13 @@ VTerm *vterm_build(const struct VTermBuilder *builder)
   vt->rows = builder->rows;
   vt->cols = builder->cols;
 
-  vt->parser.state = NORMAL;
-
-  vt->parser.callbacks = NULL;
-  vt->parser.cbdata    = NULL;
+  parser_init(&vt->parser, allocator, builder->allocdata);
 
-  vt->parser.emit_nul  = false;
+  vt->parser.string_limit.osc = builder->osc_limit;
+  vt->parser.string_limit.dcs = builder->dcs_limit;
+  vt->parser.string_limit.apc = builder->apc_limit;
+  vt->parser.string_limit.pm  = builder->pm_limit;
+  vt->parser.string_limit.sos = builder->sos_limit;
 
   vt->outfunc = NULL;
   vt->outdata = NULL;
@@ -89,12 +111,49 @@ void vterm_free(VTerm *vt)
   if(vt->state)
     vterm_state_free(vt->state);
 
+  vterm_journal_stop(vt);
+
+  vterm_parser_free_buffers(&vt->parser);
+
   vterm_allocator_free(vt, vt->outbuffer);
   vterm_allocator_free(vt, vt->tmpbuffer);
 
   vterm_allocator_free(vt, vt);
 }
 
+VTermParser *vterm_parser_build(const struct VTermParserBuilder *builder)
+{
+  const VTermAllocatorFunctions *allocator = DEFAULT(builder->allocator, &default_allocator);
+
+  VTermParser *parser = (*allocator->malloc)(sizeof(VTermParser), builder->allocdata);
+
+  parser_init(parser, allocator, builder->allocdata);
+
+  parser->utf8 = builder->utf8;
+
+  parser->callbacks = builder->callbacks;
+  parser->cbdata    = builder->cbdata;
+
+  parser->emit_nul  = builder->emit_nul;
+
+  parser->string_limit.osc = builder->osc_limit;
+  parser->string_limit.dcs = builder->dcs_limit;
+  parser->string_limit.apc = builder->apc_limit;
+  parser->string_limit.pm  = builder->pm_limit;
+  parser->string_limit.sos = builder->sos_limit;
+
+  parser->whole.max = builder->whole_string_max;
+
+  return parser;
+}
+
+void vterm_parser_free(VTermParser *parser)
+{
+  vterm_parser_free_buffers(parser);
+
+  (*parser->allocator->free)(parser, parser->allocdata);
+}
+
 INTERNAL void *vterm_allocator_malloc(VTerm *vt, size_t size)
 {
   return (*vt->allocator->malloc)(size, vt->allocdata);
@@ -133,6 +192,7 @@ int vterm_get_utf8(const VTerm *vt)
 void vterm_set_utf8(VTerm *vt, int is_utf8)
 {
   vt->mode.utf8 = is_utf8;
+  vt->parser.utf8 = is_utf8;
 }
 
 void vterm_output_set_callback(VTerm *vt, VTermOutputCallback *func, void *user)
@@ -296,6 +356,7 @@ VTermValueType vterm_get_prop_type(VTermProp prop)
     case VTERM_PROP_CURSORSHAPE:   return VTERM_VALUETYPE_INT;
     case VTERM_PROP_MOUSE:         return VTERM_VALUETYPE_INT;
     case VTERM_PROP_FOCUSREPORT:   return VTERM_VALUETYPE_BOOL;
+    case VTERM_PROP_SYNCOUTPUT:    return VTERM_VALUETYPE_BOOL;
 
     case VTERM_N_PROPS: return 0;
   }
@@ -24,6 +24,8 @@
 #define CSI_ARGS_MAX 16
 #define CSI_LEADER_MAX 16
 
+#define PULL_EVENTS_MAX 16
+
 #define BUFIDX_PRIMARY   0
 #define BUFIDX_ALTSCREEN 1
 
@@ -36,22 +38,6 @@ typedef struct {
   char           data[4*sizeof(uint32_t)];
 } VTermEncodingInstance;
 
-struct VTermPen
-{
-  VTermColor fg;
-  VTermColor bg;
-  unsigned int bold:1;
-  unsigned int underline:2;
-  unsigned int italic:1;
-  unsigned int blink:1;
-  unsigned int reverse:1;
-  unsigned int conceal:1;
-  unsigned int strike:1;
-  unsigned int font:4; /* To store 0-9 */
-  unsigned int small:1;
-  unsigned int baseline:2;
-};
-
 struct VTermState
 {
   VTerm *vt;
@@ -59,9 +45,21 @@ struct VTermState
   const VTermStateCallbacks *callbacks;
   void *cbdata;
 
+  /* The screen, while its own callbacks are the ones set, so that the
+   * hottest of them are called directly rather than through callbacks */
+  VTermScreen *screen;
+
   const VTermStateFallbacks *fallbacks;
   void *fbdata;
 
+  /* Registered sequence handlers, in an open-addressed hash table whose
+   * size is a power of two */
+  struct {
+    struct VTermStateHandler *entries;
+    size_t size;
+    size_t count;
+  } handlers;
+
   int rows;
   int cols;
 
@@ -120,6 +118,7 @@ struct VTermState
     unsigned int leftrightmargin:1;
     unsigned int bracketpaste:1;
     unsigned int report_focus:1;
+    unsigned int sync_output:1;
   } mode;
 
   VTermEncodingInstance encoding[4], encoding_utf8;
@@ -173,6 +172,109 @@ struct VTermState
   } selection;
 };
 
+/* Buffer and pending events for vterm_parser_next_event(). Events are
+ * gathered a batch at a time, which ends once fewer than four slots are
+ * left, as one byte can give a string fragment (two, if a whole string
+ * being gathered outgrows its buffer), a control, and the start of the next
+ * fragment if the buffer ends there. A CSI, escape or DCS also ends the
+ * batch, as its event points into the parser state */
+struct VTermParserPull {
+  const char *bytes;
+  size_t len, pos;
+  int nevents, nextevent;
+  bool full;
+  VTermParserEvent events[PULL_EVENTS_MAX];
+  char escape[INTERMED_MAX+1];
+};
+
+struct VTermParser
+{
+  const VTermAllocatorFunctions *allocator;
+  void *allocdata;
+
+  bool utf8;
+
+  enum VTermParserState {
+    NORMAL,
+    ESCAPE,
+    ESCAPE_INTERMED,
+    CSI_LEADER,
+    CSI_ARGS,
+    CSI_INTERMED,
+    DCS_COMMAND,
+    /* below here are the "string states" */
+    OSC_COMMAND,
+    OSC,
+    DCS,
+    APC,
+    PM,
+    SOS,
+    /* ... and the same again, just after an ESC */
+    OSC_COMMAND_ESC,
+    OSC_ESC,
+    DCS_ESC,
+    APC_ESC,
+    PM_ESC,
+    SOS_ESC,
+
+    N_PARSER_STATES
+  } state;
+
+  int intermedlen;
+  char intermed[INTERMED_MAX];
+
+  union {
+    struct {
+      int leaderlen;
+      char leader[CSI_LEADER_MAX];
+
+      int argi;
+      long args[CSI_ARGS_MAX];
+    } csi;
+    struct {
+      int command;
+    } osc;
+    struct {
+      int commandlen;
+      char command[CSI_LEADER_MAX];
+    } dcs;
+  } v;
+
+  const VTermParserCallbacks *callbacks;
+  void *cbdata;
+
+  bool string_initial;
+
+  /* Payload limits for each string type, 0 meaning none. A string that
+   * goes over its limit is skipped until its terminator, its remaining
+   * bytes only being counted */
+  struct {
+    size_t osc, dcs, apc, pm, sos;
+  } string_limit;
+  size_t string_len;
+  bool string_skip;
+  size_t string_discarded;
+
+  bool emit_nul;
+
+  /* Strings gathered to be delivered whole, up to max bytes, 0 meaning
+   * fragments are delivered as they arrive. limit is max as it was when the
+   * current string began, and drops to 0 once the string outgrows it, the
+   * rest of it then being delivered as it arrives */
+  struct {
+    size_t max, limit;
+    char *buffer;
+    size_t len, size;
+  } whole;
+
+  /* Set while parsing for vterm_parser_next_event() */
+  bool pulling;
+  struct VTermParserPull *pull; /* allocated on first use */
+
+  /* NULL unless enabled by vterm_parser_set_csi_cache() */
+  struct VTermCSICache *csi_cache;
+};
+
 struct VTerm
 {
   const VTermAllocatorFunctions *allocator;
@@ -186,51 +288,20 @@ struct VTerm
     unsigned int ctrl8bit:1;
   } mode;
 
+  VTermParser parser;
+
+  /* While recording, the journal sits in place of the parser callbacks and
+   * passes each event on to the ones saved here */
   struct {
-    enum VTermParserState {
-      NORMAL,
-      CSI_LEADER,
-      CSI_ARGS,
-      CSI_INTERMED,
-      DCS_COMMAND,
-      /* below here are the "string states" */
-      OSC_COMMAND,
-      OSC,
-      DCS,
-      APC,
-      PM,
-      SOS,
-    } state;
-
-    bool in_esc : 1;
-
-    int intermedlen;
-    char intermed[INTERMED_MAX];
-
-    union {
-      struct {
-        int leaderlen;
-        char leader[CSI_LEADER_MAX];
-
-        int argi;
-        long args[CSI_ARGS_MAX];
-      } csi;
-      struct {
-        int command;
-      } osc;
-      struct {
-        int commandlen;
-        char command[CSI_LEADER_MAX];
-      } dcs;
-    } v;
+    VTermOutputCallback *func;
+    void *user;
 
     const VTermParserCallbacks *callbacks;
     void *cbdata;
 
-    bool string_initial;
-
-    bool emit_nul;
-  } parser;
+    char  *buffer;
+    size_t buffer_cur;
+  } journal;
 
   /* len == malloc()ed size; cur == number of valid bytes */
 
@@ -263,6 +334,8 @@ typedef enum {
 void *vterm_allocator_malloc(VTerm *vt, size_t size);
 void  vterm_allocator_free(VTerm *vt, void *ptr);
 
+void vterm_parser_free_buffers(VTermParser *parser);
+
 void vterm_push_output_bytes(VTerm *vt, const char *bytes, size_t len);
 void vterm_push_output_vsprintf(VTerm *vt, const char *format, va_list args);
 void vterm_push_output_sprintf(VTerm *vt, const char *format, ...);
@@ -273,6 +346,7 @@ void vterm_state_free(VTermState *state);
 
 void vterm_state_newpen(VTermState *state);
 void vterm_state_resetpen(VTermState *state);
+void vterm_state_initpen(VTermState *state);
 void vterm_state_setpen(VTermState *state, const long args[], int argcount);
 int  vterm_state_getpen(VTermState *state, long args[], int argcount);
 void vterm_state_savepen(VTermState *state, int save);
@@ -289,6 +363,16 @@ void vterm_state_push_output_sprintf_CSI(VTermState *vts, const char *format, ..
 
 void vterm_screen_free(VTermScreen *screen);
 
+extern INTERNAL const VTermStateCallbacks vterm_screen_state_callbacks;
+
+int vterm_screen_putglyph(VTermGlyphInfo *info, VTermPos pos, void *user);
+int vterm_screen_putglyphs(const VTermGlyphInfo info[], int count, VTermPos pos, void *user);
+int vterm_screen_movecursor(VTermPos pos, VTermPos oldpos, int visible, void *user);
+int vterm_screen_scrollrect(VTermRect rect, int downward, int rightward, void *user);
+int vterm_screen_erase(VTermRect rect, int selective, void *user);
+int vterm_screen_setpenattr(VTermAttr attr, VTermValue *val, void *user);
+int vterm_screen_setpen(const VTermPen *pen, void *user);
+
 VTermEncoding *vterm_lookup_encoding(VTermEncodingType type, char designation);
 
 int vterm_unicode_width(uint32_t codepoint);
@@ -103,6 +103,7 @@ static VTermColor strpe_color(char **strp)
 
 static VTerm *vt;
 static VTermState *state;
+static VTermParser *parser;
 static VTermScreen *screen;
 
 static VTermEncodingInstance encoding;
@@ -114,6 +115,16 @@ static void term_output(const char *s, size_t len, void *user)
     printf("%x%s", (unsigned char)s[i], i < len-1 ? "," : "\n");
 }
 
+static char journal[4096];
+static size_t journal_len;
+
+static void journal_output(const char *s, size_t len, void *user)
+{
+  assert(journal_len + len <= sizeof(journal));
+  memcpy(journal + journal_len, s, len);
+  journal_len += len;
+}
+
 static void printhex(const char *s, size_t len)
 {
   while(len--)
@@ -304,6 +315,26 @@ static VTermStateFallbacks fallbacks = {
   .sos     = parser_sos,
 };
 
+/* Registered handlers just print what they are given */
+
+static int handler_csi(const char *leader, const long args[], int argcount, const char *intermed, char command, void *user)
+{
+  printf("handled ");
+  return parser_csi(leader, args, argcount, intermed, command, user);
+}
+
+static int handler_osc(int command, VTermStringFragment frag, void *user)
+{
+  printf("handled ");
+  return parser_osc(command, frag, user);
+}
+
+static int handler_dcs(const char *command, size_t commandlen, VTermStringFragment frag, void *user)
+{
+  printf("handled ");
+  return parser_dcs(command, commandlen, frag, user);
+}
+
 /* These callbacks are shared by State and Screen */
 
 static int want_movecursor = 0;
@@ -472,6 +503,26 @@ static int state_setpenattr(VTermAttr attr, VTermValue *val, void *user)
   return 1;
 }
 
+static int state_setpen(const VTermPen *pen, void *user)
+{
+  printf("setpen\n");
+
+  state_pen.bold       = pen->bold;
+  state_pen.underline  = pen->underline;
+  state_pen.italic     = pen->italic;
+  state_pen.blink      = pen->blink;
+  state_pen.reverse    = pen->reverse;
+  state_pen.conceal    = pen->conceal;
+  state_pen.strike     = pen->strike;
+  state_pen.font       = pen->font;
+  state_pen.small      = pen->small;
+  state_pen.baseline   = pen->baseline;
+  state_pen.foreground = pen->fg;
+  state_pen.background = pen->bg;
+
+  return 1;
+}
+
 static int state_setlineinfo(int row, const VTermLineInfo *newinfo, const VTermLineInfo *oldinfo, void *user)
 {
   return 1;
@@ -568,7 +619,23 @@ static int screen_damage(VTermRect rect, void *user)
   return 1;
 }
 
+static int screen_damage_region(const VTermRect rects[], int count, void *user)
+{
+  if(!want_screen_damage)
+    return 1;
+
+  printf("damage_region");
+  for(int i = 0; i < count; i++)
+    printf(" %d..%d,%d..%d",
+        rects[i].start_row, rects[i].end_row, rects[i].start_col, rects[i].end_col);
+  printf("\n");
+
+  return 1;
+}
+
 static int want_screen_scrollback = 0;
+static int want_screen_scrollback_raw = 0;
+
 static int screen_sb_pushline(int cols, const VTermScreenCell *cells, void *user)
 {
   if(!want_screen_scrollback)
@@ -586,6 +653,41 @@ static int screen_sb_pushline(int cols, const VTermScreenCell *cells, void *user
   return 1;
 }
 
+static int screen_sb_pushline_raw(const VTermScreenRow *row, void *user)
+{
+  if(!want_screen_scrollback_raw)
+    return 0;
+
+  printf("sb_pushline_raw %d", row->cols);
+
+  VTermScreenRowIter iter;
+  vterm_screen_row_iter_init(&iter, row);
+  const VTermScreenRowRun *run;
+  int start, end;
+  while((run = vterm_screen_row_iter_next(&iter, &start, &end))) {
+    printf(" %d..%d{", start, end);
+    if(run->attrs.bold)      printf("B");
+    if(run->attrs.underline) printf("U%d", run->attrs.underline);
+    if(run->attrs.italic)    printf("I");
+    if(run->attrs.reverse)   printf("R");
+    printf("}");
+  }
+
+  VTermScreenCell cells[row->cols];
+  vterm_screen_row_get_cells(row, cells, row->cols);
+
+  int eol = row->cols;
+  while(eol && !cells[eol-1].chars[0])
+    eol--;
+
+  printf(" =");
+  for(int c = 0; c < eol; c++)
+    printf(" %02X", cells[c].chars[0]);
+  printf("\n");
+
+  return 1;
+}
+
 static int screen_sb_popline(int cols, VTermScreenCell *cells, void *user)
 {
   if(!want_screen_scrollback)
@@ -622,6 +724,8 @@ VTermScreenCallbacks screen_cbs = {
   .sb_pushline = screen_sb_pushline,
   .sb_popline  = screen_sb_popline,
   .sb_clear    = screen_sb_clear,
+  .damage_region = screen_damage_region,
+  .sb_pushline_raw = screen_sb_pushline_raw,
 };
 
 int main(int argc, char **argv)
@@ -640,13 +744,61 @@ int main(int argc, char **argv)
     if((nl = strchr(line, '\n')))
       *nl = '\0';
 
-    if(streq(line, "INIT")) {
-      if(!vt)
-        vt = vterm_new(25, 80);
+    if(strstartswith(line, "INIT") && (line[4] == '\0' || line[4] == ' ')) {
+      if(!vt) {
+        struct VTermBuilder builder = { .rows = 25, .cols = 80 };
+
+        /* Optional string limits, as e.g. osc=8 dcs=4 */
+        char *linep = line + 4;
+        char type[4];
+        size_t limit;
+        int len;
+        while(sscanf(linep, " %3[a-z]=%zu%n", type, &limit, &len) == 2) {
+          if(streq(type, "osc"))
+            builder.osc_limit = limit;
+          else if(streq(type, "dcs"))
+            builder.dcs_limit = limit;
+          else if(streq(type, "apc"))
+            builder.apc_limit = limit;
+          else if(streq(type, "pm"))
+            builder.pm_limit = limit;
+          else if(streq(type, "sos"))
+            builder.sos_limit = limit;
+          linep += len;
+        }
+
+        vt = vterm_build(&builder);
+      }
 
       vterm_output_set_callback(vt, term_output, NULL);
     }
 
+    else if(strstartswith(line, "REGISTER ") || strstartswith(line, "UNREGISTER ")) {
+      assert(state);
+      int reg = line[0] == 'R';
+      char *linep = line + (reg ? 9 : 11);
+      int ok = 0;
+
+      if(strstartswith(linep, "csi ")) {
+        /* Leader bytes, then intermediates, then the final byte */
+        char leader[16] = "", intermed[16] = "";
+        int l = 0, i = 0;
+        linep += 4;
+        while(linep[0] >= 0x3c && linep[0] <= 0x3f && linep[1])
+          leader[l++] = *linep++;
+        while(linep[0] >= 0x20 && linep[0] <= 0x2f && linep[1])
+          intermed[i++] = *linep++;
+        ok = vterm_state_register_csi(state, leader, intermed, linep[0], reg ? handler_csi : NULL, NULL);
+      }
+      else if(strstartswith(linep, "osc "))
+        ok = vterm_state_register_osc(state, atoi(linep + 4), reg ? handler_osc : NULL, NULL);
+      else if(strstartswith(linep, "dcs "))
+        ok = vterm_state_register_dcs(state, linep + 4, strlen(linep + 4), reg ? handler_dcs : NULL, NULL);
+
+      if(!ok)
+        fprintf(stderr, "! register failed\n");
+    }
+
     else if(streq(line, "WANTPARSER")) {
       assert(vt);
       vterm_parser_set_callbacks(vt, &parser_cbs, NULL);
@@ -698,6 +850,10 @@ int main(int argc, char **argv)
         case 'b':
           want_state_scrollback = sense;
           break;
+        case 'P':
+          state_cbs.setpen = sense ? state_setpen : NULL;
+          vterm_state_set_callbacks(state, &state_cbs, NULL);
+          break;
         default:
           fprintf(stderr, "Unrecognised WANTSTATE flag '%c'\n", line[i]);
         }
@@ -740,6 +896,9 @@ int main(int argc, char **argv)
         case 'b':
           want_screen_scrollback = sense;
           break;
+        case 'B':
+          want_screen_scrollback_raw = sense;
+          break;
         case 'r':
           vterm_screen_enable_reflow(screen, sense);
           break;
@@ -781,6 +940,85 @@ int main(int argc, char **argv)
         fprintf(stderr, "! short write\n");
     }
 
+    else if(strstartswith(line, "PARSE ")) {
+      char *bytes = line + 6;
+      size_t len = inplace_hex2bytes(bytes);
+      assert(len);
+
+      /* A standalone parser, in the UTF-8 mode the terminal had when it was
+       * first used */
+      if(!parser)
+        parser = vterm_parser_build(&(const struct VTermParserBuilder){
+            .callbacks = &parser_cbs,
+            .utf8      = vt && vterm_get_utf8(vt),
+          });
+
+      size_t written = vterm_parser_write(parser, bytes, len);
+      if(written < len)
+        fprintf(stderr, "! short write\n");
+    }
+
+    else if(strstartswith(line, "PULL ")) {
+      char *bytes = line + 5;
+      size_t len = inplace_hex2bytes(bytes);
+      assert(len);
+
+      vterm_parser_feed(vt, bytes, len);
+
+      VTermParserEvent ev;
+      while(vterm_parser_next_event(vt, &ev))
+        switch(ev.type) {
+          case VTERM_PARSER_EVENT_TEXT:
+            parser_text(ev.v.text.bytes, ev.v.text.len, NULL);
+            break;
+          case VTERM_PARSER_EVENT_CONTROL:
+            parser_control(ev.v.control, NULL);
+            break;
+          case VTERM_PARSER_EVENT_ESCAPE:
+            parser_escape(ev.v.escape.bytes, ev.v.escape.len, NULL);
+            break;
+          case VTERM_PARSER_EVENT_CSI:
+            parser_csi(ev.v.csi.leader, ev.v.csi.args, ev.v.csi.argcount, ev.v.csi.intermed, ev.v.csi.command, NULL);
+            break;
+          case VTERM_PARSER_EVENT_OSC:
+            parser_osc(ev.v.osc.command, ev.v.osc.frag, NULL);
+            break;
+          case VTERM_PARSER_EVENT_DCS:
+            parser_dcs(ev.v.dcs.command, ev.v.dcs.commandlen, ev.v.dcs.frag, NULL);
+            break;
+          case VTERM_PARSER_EVENT_APC:
+            parser_apc(ev.v.frag, NULL);
+            break;
+          case VTERM_PARSER_EVENT_PM:
+            parser_pm(ev.v.frag, NULL);
+            break;
+          case VTERM_PARSER_EVENT_SOS:
+            parser_sos(ev.v.frag, NULL);
+            break;
+        }
+    }
+
+    else if(streq(line, "CSICACHE")) {
+      vterm_parser_set_csi_cache(vt, true);
+    }
+
+    else if(strstartswith(line, "WHOLESTRINGS ")) {
+      vterm_parser_set_whole_strings(vt, strtoul(line + 13, NULL, 10));
+    }
+
+    else if(streq(line, "JOURNALSTART")) {
+      journal_len = 0;
+      vterm_journal_start(vt, journal_output, NULL);
+    }
+
+    else if(streq(line, "JOURNALREPLAY")) {
+      vterm_journal_stop(vt);
+
+      size_t done = vterm_journal_replay(vt, journal, journal_len);
+      if(done < journal_len)
+        fprintf(stderr, "! short journal replay\n");
+    }
+
     else if(streq(line, "WANTENCODING")) {
       /* This isn't really external API but it's hard to get this out any
        * other way
@@ -924,6 +1162,8 @@ int main(int argc, char **argv)
         vterm_screen_set_damage_merge(screen, VTERM_DAMAGE_SCREEN);
       else if(streq(linep, "SCROLL"))
         vterm_screen_set_damage_merge(screen, VTERM_DAMAGE_SCROLL);
+      else if(streq(linep, "REGION"))
+        vterm_screen_set_damage_merge(screen, VTERM_DAMAGE_REGION);
     }
 
     else if(strstartswith(line, "DAMAGEFLUSH")) {
@@ -931,6 +1171,33 @@ int main(int argc, char **argv)
       vterm_screen_flush_damage(screen);
     }
 
+    else if(strstartswith(line, "SYNCTIMEOUT ")) {
+      assert(screen);
+      vterm_screen_set_sync_timeout(screen, atoi(line + 12));
+    }
+
+    else if(strstartswith(line, "ADVANCETIME ")) {
+      assert(screen);
+      vterm_screen_advance_time(screen, atoi(line + 12));
+    }
+
+    else if(strstartswith(line, "DIRTYPOLL")) {
+      static uint64_t since_gen = 0;
+      assert(screen);
+      VTermDirtyRow rows[256];
+      int count = vterm_screen_get_dirty_rows(screen, since_gen, rows, 256);
+      since_gen = vterm_screen_get_generation(screen);
+      printf("dirty");
+      for(int i = 0; i < count; i++)
+        printf(" %d:%d..%d", rows[i].row, rows[i].start_col, rows[i].end_col);
+      printf("\n");
+    }
+
+    else if(strstartswith(line, "SCROLLBACK ")) {
+      assert(screen);
+      vterm_screen_enable_scrollback(screen, strtoul(line + 11, NULL, 10));
+    }
+
     else if(strstartswith(line, "SETDEFAULTCOL ")) {
       assert(screen);
       char *linep = line + 14;
@@ -1176,6 +1443,37 @@ int main(int argc, char **argv)
         print_color(&cell.bg);
         printf("\n");
       }
+      else if(streq(line, "?journal")) {
+        vterm_journal_flush(vt);
+        for(size_t i = 0; i < journal_len; i++)
+          printf("%02x", (unsigned char)journal[i]);
+        printf("\n");
+      }
+      else if(streq(line, "?parser_idle")) {
+        printf("%d\n", vterm_parser_is_idle(vt));
+      }
+      else if(streq(line, "?string_discarded")) {
+        printf("%zu\n", vterm_parser_get_string_discarded(vt));
+      }
+      else if(streq(line, "?csi_cache")) {
+        unsigned long hits, misses;
+        vterm_parser_get_csi_cache_stats(vt, &hits, &misses);
+        printf("%lu,%lu\n", hits, misses);
+      }
+      else if(streq(line, "?sb_lines")) {
+        assert(screen);
+        printf("%d\n", vterm_screen_get_scrollback_lines(screen));
+      }
+      else if(strstartswith(line, "?sb_text ")) {
+        assert(screen);
+        unsigned char text[256];
+        size_t len = vterm_screen_get_scrollback_text(screen, atoi(line + 9), (char *)text, sizeof(text));
+        if(len == 0)
+          printf("\n");
+        else
+          for(size_t i = 0; i < len; i++)
+            printf("0x%02x%s", text[i], i < len-1 ? "," : "\n");
+      }
       else if(strstartswith(line, "?screen_eol ")) {
         assert(screen);
         char *linep = line + 12;
@@ -1229,6 +1527,8 @@ int main(int argc, char **argv)
     printf(err ? "?\n" : "DONE\n");
   }
 
+  if(parser)
+    vterm_parser_free(parser);
   vterm_free(vt);
 
   return 0;
@@ -81,7 +81,7 @@ sub do_line
    # Commands have capitals
    elsif( $line =~ m/^([A-Z]+)/ ) {
       # Some convenience formatting
-      if( $line =~ m/^(PUSH|ENCIN) (.*)$/ ) {
+      if( $line =~ m/^(PUSH|PULL|PARSE|ENCIN) (.*)$/ ) {
          # we're evil
          my $string = eval($2);
          $line = "$1 " . unpack "H*", $string;
@@ -99,6 +99,9 @@ sub do_line
    }
    # Expectations have lowercase
    elsif( $line =~ m/^([a-z]+)/ ) {
+      # Registered state handlers print as the fallbacks do, with a prefix
+      my $prefix = $line =~ s/^(handled )// ? $1 : "";
+
       # Convenience formatting
       if( $line =~ m/^(text|encout) (.*)$/ ) {
          $line = "$1 " . join ",", map sprintf("%x", $_), eval($2);
@@ -125,7 +128,7 @@ sub do_line
       elsif( $line =~ m/^putglyph (\S+) (.*)$/ ) {
          $line = "putglyph " . join( ",", map sprintf("%x", $_), eval($1) ) . " $2";
       }
-      elsif( $line =~ m/^(?:movecursor|scrollrect|moverect|erase|damage|sb_pushline|sb_popline|sb_clear|settermprop|setmousefunc|selection-query) ?/ ) {
+      elsif( $line =~ m/^(?:movecursor|scrollrect|moverect|erase|damage|dirty|sb_pushline|sb_popline|sb_clear|settermprop|setpen|setmousefunc|selection-query) ?/ ) {
          # no conversion
       }
       elsif( $line =~ m/^(selection-set) (.*?) (\[?)(.*?)(\]?)$/ ) {
@@ -135,7 +138,7 @@ sub do_line
          warn "Unrecognised test expectation '$line'\n";
       }
 
-      push @expect, $line;
+      push @expect, "$prefix$line";
    }
    # ?screen_row assertion is emulated here
    elsif( $line =~ s/^\?screen_row\s+(\d+)\s*=\s*// ) {